@@ -0,0 +1,115 @@
+#include "acpi.h"
+#include "vmalloc.h"
+
+#define EBDA_PTR     0x40E        /* real-mode segment of the EBDA */
+#define BIOS_ROM     0xE0000
+#define BIOS_ROM_END 0x100000
+
+static const struct acpi_header *root = 0;   // RSDT or XSDT
+static int root_entry_size;                  // 4 (RSDT) or 8 (XSDT)
+
+static uint8_t checksum(const void *p, uint32_t len) {
+    const uint8_t *b = p;
+    uint8_t sum = 0;
+    while (len--)
+        sum += *b++;
+    return sum;
+}
+
+static int sig_eq(const char *a, const char *b, int n) {
+    for (int i = 0; i < n; i++)
+        if (a[i] != b[i])
+            return 0;
+    return 1;
+}
+
+static int rsdp_valid(const struct acpi_rsdp *r) {
+    if (!sig_eq(r->signature, "RSD PTR ", 8) || checksum(r, 20) != 0)
+        return 0;
+    return r->revision < 2 || checksum(r, r->length) == 0;
+}
+
+// RSDPs sit on a 16-byte boundary
+static const struct acpi_rsdp *scan(const uint8_t *p, uint32_t len) {
+    for (uint32_t off = 0; off + sizeof(struct acpi_rsdp) <= len; off += 16)
+        if (rsdp_valid((const struct acpi_rsdp *)(p + off)))
+            return (const struct acpi_rsdp *)(p + off);
+    return 0;
+}
+
+static const struct acpi_rsdp *find_rsdp(void) {
+    const struct acpi_rsdp *r = 0;
+    const uint16_t *bda = memremap_ro(EBDA_PTR, 2);
+    if (bda) {
+        uint32_t ebda = (uint32_t)*bda << 4;
+        iounmap((void *)bda);
+        const uint8_t *p = ebda ? memremap_ro(ebda, 1024) : 0;
+        if (p && (r = scan(p, 1024)))
+            return r;   // stays mapped
+        iounmap((void *)p);
+    }
+    const uint8_t *rom = memremap_ro(BIOS_ROM, BIOS_ROM_END - BIOS_ROM);
+    if (rom && (r = scan(rom, BIOS_ROM_END - BIOS_ROM)))
+        return r;
+    iounmap((void *)rom);
+    return 0;
+}
+
+// Maps a whole table: the header first to learn its length
+static const struct acpi_header *map_table(uint32_t phys) {
+    const struct acpi_header *h = memremap_ro(phys, sizeof(*h));
+    if (!h)
+        return 0;
+    uint32_t len = h->length;
+    iounmap((void *)h);
+    if (len < sizeof(*h))
+        return 0;
+    h = memremap_ro(phys, len);
+    if (h && checksum(h, len) != 0) {
+        iounmap((void *)h);
+        return 0;
+    }
+    return h;
+}
+
+int acpi_init(const void *rsdp) {
+    const struct acpi_rsdp *r = rsdp;
+    if (r && !rsdp_valid(r))
+        r = 0;
+    if (!r)
+        r = find_rsdp();
+    if (!r)
+        return -1;
+
+    // The XSDT only helps if its address fits in 32 bits
+    if (r->revision >= 2 && r->xsdt_addr && r->xsdt_addr < 0x100000000ull) {
+        root = map_table((uint32_t)r->xsdt_addr);
+        root_entry_size = 8;
+    }
+    if (!root) {
+        root = map_table(r->rsdt_addr);
+        root_entry_size = 4;
+    }
+    return root ? 0 : -1;
+}
+
+const struct acpi_header *acpi_find_table(const char *sig) {
+    if (!root)
+        return 0;
+    uint32_t n = (root->length - sizeof(*root)) / root_entry_size;
+    const uint8_t *entries = (const uint8_t *)(root + 1);
+    for (uint32_t i = 0; i < n; i++) {
+        const uint8_t *e = entries + i * root_entry_size;
+        uint32_t phys = e[0] | e[1] << 8 | e[2] << 16 | (uint32_t)e[3] << 24;
+        if (root_entry_size == 8 && (e[4] | e[5] | e[6] | e[7]))
+            continue;   // above 4 GiB
+        const struct acpi_header *h = memremap_ro(phys, sizeof(*h));
+        if (!h)
+            continue;
+        int match = sig_eq(h->signature, sig, 4);
+        iounmap((void *)h);
+        if (match)
+            return map_table(phys);
+    }
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+
+/* ===== ACPI table lookup =====
+   Just enough ACPI to find static tables such as the MADT: the RSDP comes
+   from the bootloader (multiboot_acpi_rsdp()) or a scan of the BIOS areas,
+   and the RSDT/XSDT lists every other table. Tables are mapped read-only
+   through memremap_ro() and stay mapped. */
+
+struct acpi_rsdp {
+    char signature[8];        // "RSD PTR "
+    uint8_t checksum;         // first 20 bytes sum to 0
+    char oem_id[6];
+    uint8_t revision;         // 0 for ACPI 1.0, 2 for 2.0+
+    uint32_t rsdt_addr;
+    // ACPI 2.0+
+    uint32_t length;
+    uint64_t xsdt_addr;
+    uint8_t ext_checksum;     // whole structure sums to 0
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length;          // including this header
+    uint8_t revision;
+    uint8_t checksum;         // whole table sums to 0
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// Finds and checks the root table. rsdp is the copy passed by the
+// bootloader, or NULL to search the EBDA and 0xE0000-0xFFFFF.
+// Returns 0 on success, -1 if there is no (valid) ACPI.
+int acpi_init(const void *rsdp);
+
+// The table with the given 4-character signature (e.g. "APIC" for the
+// MADT), mapped and checksummed, or NULL
+const struct acpi_header *acpi_find_table(const char *sig);
+
+#endif // ACPI_H
@@ -0,0 +1,320 @@
+#include "apic.h"
+#include "acpi.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "clockevent.h"
+#include "timer.h"
+#include "tsc.h"
+#include "vmalloc.h"
+
+void outb(uint16_t _port, uint8_t val);
+
+/* Local APIC registers (byte offsets into its 4 KiB page) */
+#define LAPIC_ID        0x020
+#define LAPIC_TPR       0x080
+#define LAPIC_EOI       0x0B0
+#define LAPIC_SVR       0x0F0
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_ICR 0x380      /* initial count */
+#define LAPIC_TIMER_CCR 0x390      /* current count */
+#define LAPIC_TIMER_DCR 0x3E0      /* divide configuration */
+
+#define APIC_BASE_ENABLE (1u << 11)   /* in MSR_APIC_BASE */
+#define SVR_ENABLE       0x100
+#define LVT_MASKED       (1u << 16)
+#define LVT_PERIODIC     (1u << 17)
+#define TIMER_DIV_16     0x3
+
+/* I/O APIC: an index register and a data window */
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WIN    0x10
+#define IOAPIC_VER    0x01         /* bits 16-23: last redirection entry */
+#define IOAPIC_REDTBL 0x10         /* entry n: 0x10 + 2n (low), 0x11 + 2n (high) */
+
+#define RTE_ACTIVE_LOW (1u << 13)
+#define RTE_LEVEL      (1u << 15)
+#define RTE_MASKED     (1u << 16)
+
+/* MADT (signature "APIC") */
+struct madt {
+    struct acpi_header h;
+    uint32_t lapic_addr;
+    uint32_t flags;                // bit 0: 8259 pair present
+} __attribute__((packed));
+
+#define MADT_LAPIC_OVERRIDE 5
+#define MADT_IOAPIC         1
+#define MADT_ISO            2      /* interrupt source override */
+
+struct madt_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct madt_ioapic {
+    struct madt_entry e;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t addr;
+    uint32_t gsi_base;
+} __attribute__((packed));
+
+struct madt_iso {
+    struct madt_entry e;
+    uint8_t bus;                   // 0: ISA
+    uint8_t source;                // ISA IRQ
+    uint32_t gsi;
+    uint16_t flags;                // bits 0-1 polarity, 2-3 trigger (3 = low / level)
+} __attribute__((packed));
+
+struct madt_lapic_override {
+    struct madt_entry e;
+    uint16_t reserved;
+    uint64_t addr;
+} __attribute__((packed));
+
+#define MAX_IOAPICS 4
+
+struct ioapic {
+    volatile uint32_t *regs;
+    uint32_t gsi_base;
+    uint32_t nr_pins;
+};
+
+static volatile uint32_t *lapic = 0;
+static struct ioapic ioapics[MAX_IOAPICS];
+static int nr_ioapics = 0;
+static int active = 0;
+
+// Where each ISA IRQ ends up: identity unless the MADT overrides it
+static struct {
+    struct ioapic *io;
+    uint32_t pin;
+    uint32_t flags;                // RTE polarity/trigger bits
+} isa_route[16];
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t v) {
+    lapic[reg / 4] = v;
+}
+
+static uint32_t ioapic_read(struct ioapic *io, uint32_t reg) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    return io->regs[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(struct ioapic *io, uint32_t reg, uint32_t v) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    io->regs[IOAPIC_WIN / 4] = v;
+}
+
+static struct ioapic *ioapic_for_gsi(uint32_t gsi) {
+    for (int i = 0; i < nr_ioapics; i++)
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].nr_pins)
+            return &ioapics[i];
+    return 0;
+}
+
+/* ===== I/O APIC as an irq_chip ===== */
+
+static void ioapic_set_masked(uint8_t irq, int masked) {
+    struct ioapic *io = isa_route[irq].io;
+    if (!io)
+        return;
+    uint32_t reg = IOAPIC_REDTBL + 2 * isa_route[irq].pin;
+    uint32_t flags = irq_save();
+    uint32_t lo = ioapic_read(io, reg);
+    ioapic_write(io, reg, masked ? lo | RTE_MASKED : lo & ~RTE_MASKED);
+    irq_restore(flags);
+}
+
+static void apic_mask(uint8_t irq) {
+    ioapic_set_masked(irq, 1);
+}
+
+static void apic_unmask(uint8_t irq) {
+    ioapic_set_masked(irq, 0);
+}
+
+static void apic_eoi(uint8_t vector) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static struct irq_chip apic_chip = {
+    .name = "ioapic",
+    .mask = apic_mask,
+    .unmask = apic_unmask,
+    .eoi = apic_eoi,
+};
+
+/* ===== Setup ===== */
+
+static int parse_madt(const struct madt *m, uint32_t *lapic_phys) {
+    *lapic_phys = m->lapic_addr;
+    for (int i = 0; i < 16; i++) {
+        isa_route[i].io = 0;
+        isa_route[i].pin = i;     // GSI for now, made relative below
+        isa_route[i].flags = 0;   // ISA default: edge, active high
+    }
+
+    const uint8_t *p = (const uint8_t *)(m + 1);
+    const uint8_t *end = (const uint8_t *)m + m->h.length;
+    while (p + sizeof(struct madt_entry) <= end) {
+        const struct madt_entry *e = (const void *)p;
+        if (e->length < sizeof(*e) || p + e->length > end)
+            break;
+        if (e->type == MADT_IOAPIC && nr_ioapics < MAX_IOAPICS) {
+            const struct madt_ioapic *ent = (const void *)e;
+            struct ioapic *io = &ioapics[nr_ioapics];
+            io->regs = ioremap(ent->addr, 0x20);
+            if (io->regs) {
+                io->gsi_base = ent->gsi_base;
+                io->nr_pins = ((ioapic_read(io, IOAPIC_VER) >> 16) & 0xFF) + 1;
+                nr_ioapics++;
+            }
+        } else if (e->type == MADT_ISO) {
+            const struct madt_iso *iso = (const void *)e;
+            if (iso->bus == 0 && iso->source < 16) {
+                isa_route[iso->source].pin = iso->gsi;
+                uint32_t f = 0;
+                if ((iso->flags & 3) == 3)
+                    f |= RTE_ACTIVE_LOW;
+                if (((iso->flags >> 2) & 3) == 3)
+                    f |= RTE_LEVEL;
+                isa_route[iso->source].flags = f;
+            }
+        } else if (e->type == MADT_LAPIC_OVERRIDE) {
+            const struct madt_lapic_override *o = (const void *)e;
+            if (o->addr < 0x100000000ull)
+                *lapic_phys = (uint32_t)o->addr;
+        }
+        p += e->length;
+    }
+    return nr_ioapics ? 0 : -1;
+}
+
+// Programs every ISA IRQ's redirection entry, masked, to vector
+// IRQ_BASE + irq on this CPU. IRQ 2 (the 8259 cascade) is never routed,
+// and neither is an IRQ whose pin another source was moved onto (QEMU's
+// IRQ0 -> GSI2): that pin belongs to the overriding source.
+static void route_isa_irqs(void) {
+    uint32_t dest = lapic_read(LAPIC_ID) >> 24;
+    uint32_t taken = 0;
+    for (uint32_t irq = 0; irq < 16; irq++)
+        if (isa_route[irq].pin != irq && isa_route[irq].pin < 16)
+            taken |= 1u << isa_route[irq].pin;
+    for (uint32_t irq = 0; irq < 16; irq++) {
+        uint32_t gsi = isa_route[irq].pin;
+        if (irq == 2 || (gsi == irq && (taken & (1u << irq))))
+            continue;
+        struct ioapic *io = ioapic_for_gsi(gsi);
+        if (!io)
+            continue;
+        isa_route[irq].io = io;
+        isa_route[irq].pin = gsi - io->gsi_base;
+        uint32_t reg = IOAPIC_REDTBL + 2 * isa_route[irq].pin;
+        ioapic_write(io, reg + 1, dest << 24);
+        ioapic_write(io, reg, (IRQ_BASE + irq) | isa_route[irq].flags | RTE_MASKED);
+    }
+}
+
+int apic_init(const void *rsdp) {
+    if (!cpu_has(CPU_FEATURE_APIC | CPU_FEATURE_MSR) || acpi_init(rsdp) < 0)
+        return -1;
+    const struct madt *m = (const struct madt *)acpi_find_table("APIC");
+    uint32_t lapic_phys;
+    if (!m || parse_madt(m, &lapic_phys) < 0)
+        return -1;
+    lapic = ioremap(lapic_phys, PAGE_SIZE);
+    if (!lapic)
+        return -1;
+
+    uint32_t flags = irq_save();
+    wrmsr(MSR_APIC_BASE, (rdmsr(MSR_APIC_BASE) & ~0xFFFull) | lapic_phys | APIC_BASE_ENABLE);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | SPURIOUS_VECTOR);
+    lapic_write(LAPIC_TPR, 0);                 // accept every priority
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    route_isa_irqs();
+    irq_set_chip(&apic_chip);                  // moves already-unmasked lines over
+    outb(PIC_1_DATA, 0xFF);                    // 8259 pair fully masked
+    outb(PIC_2_DATA, 0xFF);
+    active = 1;
+    irq_restore(flags);
+    return 0;
+}
+
+int apic_active(void) {
+    return active;
+}
+
+/* ===== Local APIC timer as a clock event device ===== */
+
+#define CALIBRATE_MS 10u
+
+static uint32_t lapic_loaded;   // count the timer was last started with
+
+static void lapic_timer_start(uint32_t lvt, uint32_t count) {
+    lapic_write(LAPIC_LVT_TIMER, lvt);
+    lapic_write(LAPIC_TIMER_ICR, count);   // writing the count starts it
+    lapic_loaded = count;
+}
+
+static struct clock_event_device lapic_clockevent;
+
+static void lapic_set_periodic(void) {
+    lapic_timer_start(LOCAL_VECTOR_BASE | LVT_PERIODIC, lapic_clockevent.counts_per_tick);
+}
+
+static void lapic_set_oneshot(uint32_t counts) {
+    lapic_timer_start(LOCAL_VECTOR_BASE, counts);
+}
+
+static uint32_t lapic_elapsed(void) {
+    // Periodic mode reloads the count; one-shot mode stops at 0
+    return lapic_loaded - lapic_read(LAPIC_TIMER_CCR);
+}
+
+static int lapic_expired(void) {
+    return lapic_read(LAPIC_TIMER_CCR) == 0;
+}
+
+static struct clock_event_device lapic_clockevent = {
+    .name = "lapic",
+    .set_periodic = lapic_set_periodic,
+    .set_oneshot = lapic_set_oneshot,
+    .elapsed = lapic_elapsed,
+    .expired = lapic_expired,
+};
+
+static void lapic_timer_irq(struct trap_frame *tf) {
+    clockevent_handle_irq();
+}
+
+int apic_timer_init(void) {
+    if (!active || !tsc_khz)
+        return -1;
+
+    // Count down from the top for CALIBRATE_MS of TSC time, masked
+    lapic_write(LAPIC_TIMER_DCR, TIMER_DIV_16);
+    lapic_timer_start(LOCAL_VECTOR_BASE | LVT_MASKED, 0xFFFFFFFF);
+    uint64_t end = rdtsc() + (uint64_t)tsc_khz * CALIBRATE_MS;
+    while (rdtsc() < end)
+        ;
+    uint32_t counted = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CCR);
+    lapic_write(LAPIC_TIMER_ICR, 0);           // stop it
+    uint32_t per_sec = counted * (1000 / CALIBRATE_MS);
+    if (per_sec < HZ)
+        return -1;
+
+    lapic_clockevent.counts_per_tick = (per_sec + HZ / 2) / HZ;
+    // nohz_enter() adds up to one tick to this, so leave room
+    lapic_clockevent.max_counts = 0x7FFFFFFF;
+    if (register_interrupt_handler(LOCAL_VECTOR_BASE, lapic_timer_irq) < 0)
+        return -1;
+    register_irq_handler(0, 0);                // PIT IRQ0 masked and released
+    clockevent_register(&lapic_clockevent);
+    return 0;
+}
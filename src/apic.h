@@ -0,0 +1,27 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+
+/* ===== Local APIC and I/O APIC =====
+   apic_init() finds the interrupt controllers in the ACPI MADT, maps their
+   registers with ioremap(), routes the 16 ISA IRQs through the I/O APIC
+   (honouring the MADT's source overrides, e.g. PIT IRQ0 -> GSI2) to the
+   same vectors the PIC used, and masks the 8259 pair. EOI is then a single
+   MMIO write to the local APIC instead of one or two port writes. Without
+   a local APIC (CPUID) or MADT, interrupts stay on the 8259. */
+
+// rsdp: the bootloader's copy of the ACPI RSDP, or NULL to search for it.
+// Call after init_idt() and vmalloc_init(), before unmasking any IRQ.
+// Returns 0 if the APIC is now in use, -1 if the PIC still is.
+int apic_init(const void *rsdp);
+
+// Nonzero once apic_init() switched to the APIC
+int apic_active(void);
+
+// Calibrates the local APIC timer against the TSC and makes it the tick
+// device in place of the PIT (whose IRQ0 is masked). Returns -1, leaving
+// the PIT alone, without an active APIC or a calibrated TSC.
+int apic_timer_init(void);
+
+#endif // APIC_H
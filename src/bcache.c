@@ -0,0 +1,399 @@
+#include "bcache.h"
+#include "interrupt.h"
+#include "sched.h"
+#include "timer.h"
+#include "rprintf.h"
+#include "kmalloc.h"
+#include "paging.h"
+
+#define BUFS_PER_PAGE (PAGE_SIZE / BLOCK_SIZE)
+#define MAX_BUFS      (BCACHE_MAX_PAGES * BUFS_PER_PAGE)
+#define BOUNCE_ORDER  4                  // 16 pages = BCACHE_RUN_MAX sectors
+
+uint32_t bcache_hits = 0, bcache_misses = 0, bcache_evictions = 0, bcache_rewrites = 0;
+uint32_t bcache_sectors_out = 0, bcache_commands = 0;
+
+static struct kmem_cache *buf_cache = NULL;
+static struct buf *hash[BCACHE_HASH_BUCKETS];
+static struct buf lru = { .lru_prev = &lru, .lru_next = &lru };   // next: most recently used
+static struct buf *bufs[MAX_BUFS];       // every buffer, for writeback()
+static struct buf *sorted[MAX_BUFS];
+static uint32_t nbufs = 0, ndirty = 0;
+static uint8_t *bounce;                  // physically contiguous
+
+// Held across disk I/O, so a sleeping writeback can't race a bdirty()
+static int busy = 0;
+static struct wait_queue lock_wq;
+
+static struct wait_queue flusher_wq;
+static volatile int sync_requested = 0;
+
+/* ===== Helpers ===== */
+
+static void bcache_lock(void) {
+    uint32_t flags = irq_save();
+    while (busy)
+        wait_on(&lock_wq);
+    busy = 1;
+    irq_restore(flags);
+}
+
+static void bcache_unlock(void) {
+    busy = 0;
+    wake_up(&lock_wq);
+}
+
+static void copy_block(void *dst, const void *src) {
+    uint32_t *d = dst;
+    const uint32_t *s = src;
+    for (uint32_t i = 0; i < BLOCK_SIZE / 4; i++)
+        d[i] = s[i];
+}
+
+static int dev_rw(uint32_t dev, uint64_t lba, void *buffer, uint32_t count, int write) {
+    if (dev != BDEV_ATA)
+        return ATA_ERR_DEVICE;
+    return write ? ata_write(lba, buffer, count) : ata_read(lba, buffer, count);
+}
+
+static int in_range(uint32_t dev, uint64_t lba, uint32_t count) {
+    const struct ata_info *id = ata_info();
+    return buf_cache && dev == BDEV_ATA && count && lba + count <= id->sectors && lba + count > lba;
+}
+
+// Low LBA bits: a run of adjacent sectors spreads over the buckets
+static inline struct buf **bucket(uint32_t dev, uint64_t lba) {
+    return &hash[((uint32_t)lba + dev) & (BCACHE_HASH_BUCKETS - 1)];
+}
+
+static struct buf *lookup(uint32_t dev, uint64_t lba) {
+    struct buf *b = *bucket(dev, lba);
+    while (b && (b->lba != lba || b->dev != dev))
+        b = b->hash_next;
+    return b;
+}
+
+static void unhash(struct buf *b) {
+    struct buf **pp = bucket(b->dev, b->lba);
+    while (*pp != b)
+        pp = &(*pp)->hash_next;
+    *pp = b->hash_next;
+}
+
+static void lru_remove(struct buf *b) {
+    b->lru_prev->lru_next = b->lru_next;
+    b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void lru_insert(struct buf *b, struct buf *prev) {
+    b->lru_prev = prev;
+    b->lru_next = prev->lru_next;
+    prev->lru_next->lru_prev = b;
+    prev->lru_next = b;
+}
+
+static int expired(const struct buf *b) {
+    return time_after_eq(jiffies, b->dirtied + msecs_to_jiffies(BCACHE_AGE_MS));
+}
+
+static int before(const struct buf *a, const struct buf *b) {
+    return a->dev != b->dev ? a->dev < b->dev : a->lba < b->lba;
+}
+
+// Shell sort on (dev, lba); n is at most MAX_BUFS
+static void sort_bufs(struct buf **a, uint32_t n) {
+    for (uint32_t gap = n / 2; gap; gap /= 2) {
+        for (uint32_t i = gap; i < n; i++) {
+            struct buf *t = a[i];
+            uint32_t j = i;
+            for (; j >= gap && before(t, a[j - gap]); j -= gap)
+                a[j] = a[j - gap];
+            a[j] = t;
+        }
+    }
+}
+
+/* ===== Writeback ===== */
+
+// One command for n adjacent buffers. They stay dirty if it fails.
+static int write_run(struct buf **run, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++)
+        copy_block(bounce + i * BLOCK_SIZE, run[i]->data);
+    int ret = dev_rw(run[0]->dev, run[0]->lba, bounce, n, 1);
+    bcache_commands++;
+    if (ret < 0)
+        return ret;
+    for (uint32_t i = 0; i < n; i++)
+        run[i]->flags &= ~B_DIRTY;
+    ndirty -= n;
+    bcache_sectors_out += n;
+    return 0;
+}
+
+// Writes out, in (dev, LBA) order, every run of adjacent dirty buffers
+// (all) or only those holding an expired one. Locked. Returns the first
+// error.
+static int writeback(int all) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < nbufs; i++)
+        if (bufs[i]->flags & B_DIRTY)
+            sorted[n++] = bufs[i];
+    sort_bufs(sorted, n);
+
+    int ret = 0;
+    uint32_t i = 0;
+    while (i < n) {
+        int due = all || expired(sorted[i]);
+        uint32_t j = i + 1;
+        for (; j < n && sorted[j]->dev == sorted[i]->dev &&
+               sorted[j]->lba == sorted[j - 1]->lba + 1; j++)
+            due |= expired(sorted[j]);
+        for (uint32_t k = i; due && k < j; k += BCACHE_RUN_MAX) {
+            int r = write_run(&sorted[k], j - k < BCACHE_RUN_MAX ? j - k : BCACHE_RUN_MAX);
+            if (r < 0 && ret == 0)
+                ret = r;
+        }
+        i = j;
+    }
+    return ret;
+}
+
+static void flusher(void *arg) {
+    for (;;) {
+        uint32_t flags = irq_save();
+        if (!sync_requested)
+            wait_on_timeout(&flusher_wq, msecs_to_jiffies(BCACHE_INTERVAL_MS));
+        int all = sync_requested;
+        sync_requested = 0;
+        irq_restore(flags);
+
+        bcache_lock();
+        if (ndirty)
+            writeback(all);
+        if (all)
+            ata_flush();
+        bcache_unlock();
+    }
+}
+
+/* ===== Buffer management (locked) ===== */
+
+// One more page of buffers, at the cold end of the LRU list where
+// alloc_buf() looks first
+static int grow(void) {
+    if (nbufs + BUFS_PER_PAGE > MAX_BUFS || pfa_free_count() < BCACHE_LOW_FRAMES)
+        return -1;
+    uint8_t *page = pfa_alloc_frames(0);
+    if (!page)
+        return -1;
+    for (uint32_t i = 0; i < BUFS_PER_PAGE; i++) {
+        struct buf *b = kmem_cache_alloc(buf_cache);
+        if (!b) {
+            if (i == 0)
+                pfa_free_frames(page, 0);
+            return i ? 0 : -1;
+        }
+        b->flags = 0;
+        b->refcnt = 0;
+        b->data = page + i * BLOCK_SIZE;
+        bufs[nbufs++] = b;
+        lru_insert(b, lru.lru_prev);
+    }
+    return 0;
+}
+
+// The least recently used clean buffer, stripped of its identity
+static struct buf *recycle(void) {
+    for (struct buf *b = lru.lru_prev; b != &lru; b = b->lru_prev) {
+        if (b->flags & B_DIRTY)
+            continue;
+        if (b->flags & B_HASHED) {
+            unhash(b);
+            bcache_evictions++;
+        }
+        b->flags = 0;
+        return b;
+    }
+    return 0;
+}
+
+// Never-used buffers first, then a new page, then the LRU clean buffer.
+// With none of those, memory is short: everything dirty goes out.
+static struct buf *alloc_buf(void) {
+    struct buf *cold = lru.lru_prev;
+    if (cold == &lru || (cold->flags & B_HASHED))
+        grow();
+    struct buf *b = recycle();
+    if (!b && ndirty && writeback(1) == 0)
+        b = recycle();
+    return b;
+}
+
+// Referenced buffer for (dev, lba), found or newly assigned
+static struct buf *getblk(uint32_t dev, uint64_t lba) {
+    struct buf *b = lookup(dev, lba);
+    if (!b) {
+        if (!(b = alloc_buf()))
+            return 0;
+        b->dev = dev;
+        b->lba = lba;
+        b->flags = B_HASHED;
+        b->hash_next = *bucket(dev, lba);
+        *bucket(dev, lba) = b;
+    }
+    if (b->refcnt++ == 0)
+        lru_remove(b);
+    return b;
+}
+
+static void release(struct buf *b) {
+    if (--b->refcnt == 0)
+        lru_insert(b, &lru);
+}
+
+static void mark_dirty(struct buf *b) {
+    if (b->flags & B_DIRTY) {
+        bcache_rewrites++;          // keeps its age: it is still due on time
+    } else {
+        b->dirtied = jiffies;
+        ndirty++;
+    }
+    b->flags |= B_VALID | B_DIRTY;
+    if (ndirty >= BCACHE_DIRTY_MAX)
+        writeback(1);
+}
+
+/* ===== Public API ===== */
+
+int bcache_init(void) {
+    if (buf_cache)
+        return 0;
+    if (!ata_info())
+        return -1;
+    bounce = pfa_alloc_frames(BOUNCE_ORDER);
+    if (!bounce)
+        return -1;
+    buf_cache = kmem_cache_create("buf", sizeof(struct buf), 0);
+    if (!buf_cache || !thread_create("bflush", flusher, 0, PRIO_DEFAULT)) {
+        pfa_free_frames(bounce, BOUNCE_ORDER);
+        buf_cache = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+struct buf *bread(uint32_t dev, uint64_t lba) {
+    if (!in_range(dev, lba, 1))
+        return 0;
+    bcache_lock();
+    struct buf *b = getblk(dev, lba);
+    if (b && (b->flags & B_VALID)) {
+        bcache_hits++;
+    } else if (b) {
+        bcache_misses++;
+        if (dev_rw(dev, lba, b->data, 1, 0) == 0) {
+            b->flags |= B_VALID;
+        } else {
+            release(b);
+            b = 0;
+        }
+    }
+    bcache_unlock();
+    return b;
+}
+
+struct buf *bget(uint32_t dev, uint64_t lba) {
+    if (!in_range(dev, lba, 1))
+        return 0;
+    bcache_lock();
+    struct buf *b = getblk(dev, lba);
+    bcache_unlock();
+    return b;
+}
+
+void bdirty(struct buf *b) {
+    bcache_lock();
+    mark_dirty(b);
+    bcache_unlock();
+}
+
+int bwrite(struct buf *b) {
+    bcache_lock();
+    int ret = dev_rw(b->dev, b->lba, b->data, 1, 1);
+    if (ret == 0) {
+        if (b->flags & B_DIRTY)
+            ndirty--;
+        b->flags = (b->flags | B_VALID) & ~B_DIRTY;
+    }
+    bcache_unlock();
+    return ret;
+}
+
+void brelse(struct buf *b) {
+    bcache_lock();
+    release(b);
+    bcache_unlock();
+}
+
+int bcache_read(uint32_t dev, uint64_t lba, void *buffer, uint32_t count) {
+    if (!in_range(dev, lba, count))
+        return ATA_ERR_DEVICE;
+    bcache_lock();
+    int ret = dev_rw(dev, lba, buffer, count, 0);
+    for (uint32_t i = 0; ret == 0 && ndirty && i < count; i++) {
+        struct buf *b = lookup(dev, lba + i);
+        if (b && (b->flags & B_DIRTY))
+            copy_block((uint8_t *)buffer + i * BLOCK_SIZE, b->data);
+    }
+    bcache_unlock();
+    return ret;
+}
+
+int bcache_write(uint32_t dev, uint64_t lba, const void *buffer, uint32_t count) {
+    if (!in_range(dev, lba, count))
+        return ATA_ERR_DEVICE;
+    const uint8_t *p = buffer;
+    int ret = 0;
+    bcache_lock();
+    for (; count; count--, lba++, p += BLOCK_SIZE) {
+        struct buf *b = getblk(dev, lba);
+        if (!b) {
+            // No buffer even after a writeback: write this one through
+            int r = dev_rw(dev, lba, (void *)p, 1, 1);
+            if (r < 0 && ret == 0)
+                ret = r;
+            continue;
+        }
+        copy_block(b->data, p);
+        mark_dirty(b);
+        release(b);
+    }
+    bcache_unlock();
+    return ret;
+}
+
+int bcache_sync(void) {
+    if (!buf_cache)
+        return ata_flush();
+    bcache_lock();
+    int ret = writeback(1);
+    int r = ata_flush();
+    bcache_unlock();
+    return ret < 0 ? ret : r;
+}
+
+void bcache_kick(void) {
+    sync_requested = 1;
+    wake_up(&flusher_wq);
+}
+
+uint32_t bcache_dirty_count(void) {
+    return ndirty;
+}
+
+void bcache_dump(int (*pc)(int)) {
+    esp_printf(pc, "bcache: %d buffers, %d dirty; %d hits, %d misses, %d evictions\n",
+               nbufs, ndirty, bcache_hits, bcache_misses, bcache_evictions);
+    esp_printf(pc, "        %d rewrites; %d sectors written back in %d commands\n",
+               bcache_rewrites, bcache_sectors_out, bcache_commands);
+}
@@ -0,0 +1,104 @@
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include <stdint.h>
+#include "ide.h"
+
+/* ===== Block buffer cache =====
+   One buffer per cached sector, found through a hash table keyed by
+   (device, LBA). bread() hands out a reference to the buffer and only
+   goes to the disk on a miss. Unreferenced buffers sit on an LRU list;
+   a miss takes a fresh buffer while the cache may still grow (up to
+   BCACHE_MAX_PAGES page frames from the frame allocator, each cut into
+   PAGE_SIZE / BLOCK_SIZE buffers) and otherwise recycles the least
+   recently used clean one.
+
+   Writes are delayed. bdirty() marks a buffer, and dirty data goes to the
+   disk in (device, LBA) order, with adjacent sectors merged into one
+   command of up to BCACHE_RUN_MAX sectors:
+     - from the "bflush" thread, every BCACHE_INTERVAL_MS, for each run
+       of adjacent dirty buffers holding one dirtied BCACHE_AGE_MS ago or
+       more;
+     - all of it, once BCACHE_DIRTY_MAX buffers are dirty, or when a miss
+       finds neither room to grow (free frames below BCACHE_LOW_FRAMES)
+       nor a clean buffer to recycle;
+     - all of it, followed by FLUSH CACHE, in bcache_sync().
+
+   Buffers are shared, not locked: two users of one buffer serialise
+   their updates themselves. A buffer dirtied again while it was being
+   written out stays dirty.
+
+   The functions here sleep: call them from threads, not tasklets. */
+
+#define BLOCK_SIZE ATA_SECTOR_SIZE
+
+#define BDEV_ATA 0              /* primary master (ide.c), the only device */
+
+#define BCACHE_HASH_BUCKETS 256
+#define BCACHE_MAX_PAGES    128     /* 1024 buffers, 512 KiB */
+#define BCACHE_DIRTY_MAX    512
+#define BCACHE_LOW_FRAMES   256     /* 1 MiB */
+#define BCACHE_AGE_MS       3000
+#define BCACHE_INTERVAL_MS  1000
+#define BCACHE_RUN_MAX      128     /* sectors per write command: the bounce buffer */
+
+#define B_VALID  0x1            /* data matches the disk or is newer */
+#define B_DIRTY  0x2            /* newer than the disk */
+#define B_HASHED 0x4            /* has an identity (dev, lba) */
+
+struct buf {
+    uint32_t dev;
+    uint64_t lba;
+    uint32_t flags;
+    uint32_t refcnt;
+    uint32_t dirtied;               // jiffies when it became dirty
+    struct buf *hash_next;
+    struct buf *lru_prev, *lru_next;  // on the LRU list while refcnt == 0
+    uint8_t *data;                  // BLOCK_SIZE bytes
+};
+
+// Sets up the cache and starts the flusher thread. Call after
+// sched_init() and ide_init(). Returns 0 on success.
+int bcache_init(void);
+
+// A referenced buffer holding sector lba of dev, or NULL on an I/O error
+// or if no buffer can be had. Release it with brelse().
+struct buf *bread(uint32_t dev, uint64_t lba);
+
+// Same, without reading: for a caller about to overwrite all of it
+struct buf *bget(uint32_t dev, uint64_t lba);
+
+// Marks the data valid and newer than the disk: it gets written back later
+void bdirty(struct buf *b);
+
+// Writes the buffer out now. Returns 0 or an ATA_ERR_* code.
+int bwrite(struct buf *b);
+
+// Drops a reference from bread()/bget()
+void brelse(struct buf *b);
+
+// Multi-sector transfers through the cache, with the contract of
+// ata_read()/ata_write(). A read goes to the disk and picks up the dirty
+// buffers in the range; a write only fills buffers (writing through the
+// sectors it can't get one for).
+int bcache_read(uint32_t dev, uint64_t lba, void *buffer, uint32_t count);
+int bcache_write(uint32_t dev, uint64_t lba, const void *buffer, uint32_t count);
+
+// Writes out every dirty buffer, then issues FLUSH CACHE. Returns 0 when
+// everything written so far is on the medium.
+int bcache_sync(void);
+
+// Asks the flusher thread for a full sync, without waiting. Safe from
+// any context (the shell's `sync`).
+void bcache_kick(void);
+
+uint32_t bcache_dirty_count(void);
+
+void bcache_dump(int (*pc)(int));
+
+// Statistics: bread() hits and misses, buffers recycled, rewrites of a
+// still dirty buffer, sectors written back and the commands that did it
+extern uint32_t bcache_hits, bcache_misses, bcache_evictions, bcache_rewrites;
+extern uint32_t bcache_sectors_out, bcache_commands;
+
+#endif
@@ -0,0 +1,200 @@
+#include "clockevent.h"
+#include "timer.h"
+#include "interrupt.h"
+#include "tasklet.h"
+#include "sched.h"
+
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND  0x43
+
+void outb(uint16_t _port, uint8_t val);
+uint8_t inb(uint16_t _port);
+
+uint32_t idle_entries = 0, nohz_entries = 0;
+
+static struct clock_event_device *tick_dev = 0;
+
+/* Tickless state. All times are in device counts. Real time since boot is
+   always jiffies * counts_per_tick + carry + elapsed(), so partial jiffies
+   aren't lost across idle periods. carry goes negative when a jiffy was
+   counted early, before the periodic interrupt that would have counted it. */
+static int nohz_armed = 0;        // a one-shot is programmed for an idle period
+static uint32_t nohz_ticks = 0;   // jiffies it ends on, counted from arming
+static int32_t nohz_start;        // part of a jiffy already elapsed when armed
+static int32_t carry = 0;
+static int swallow_irq = 0;       // drop the stale interrupt of a one-shot
+                                  // already accounted for in nohz_exit()
+
+/* ===== PIT (8253/8254) channel 0 ===== */
+
+static uint32_t pit_divisor;
+static uint32_t pit_loaded;       // count the PIT was last started with
+
+static void pit_load(uint8_t mode_cmd, uint32_t count) {
+    outb(PIT_COMMAND, mode_cmd);
+    outb(PIT_CHANNEL0, count & 0xFF);
+    outb(PIT_CHANNEL0, (count >> 8) & 0xFF);   // 0 means 65536
+    pit_loaded = count;
+}
+
+static void pit_set_periodic(void) {
+    pit_load(0x34, pit_divisor);   // channel 0, lobyte/hibyte, mode 2 (rate generator)
+}
+
+static void pit_set_oneshot(uint32_t counts) {
+    pit_load(0x30, counts);        // mode 0: interrupt on terminal count
+}
+
+static uint32_t pit_elapsed(void) {
+    outb(PIT_COMMAND, 0x00);       // latch channel 0
+    uint32_t cur = inb(PIT_CHANNEL0);
+    cur |= (uint32_t)inb(PIT_CHANNEL0) << 8;
+    // Past terminal count mode 0 keeps counting down from 0xFFFF
+    return cur > pit_loaded ? pit_loaded : pit_loaded - cur;
+}
+
+static int pit_expired(void) {
+    outb(PIT_COMMAND, 0xE2);       // read-back: status of channel 0
+    return (inb(PIT_CHANNEL0) & 0x80) != 0;   // OUT pin goes high at terminal count
+}
+
+static struct clock_event_device pit_clockevent = {
+    .name = "pit",
+    .set_periodic = pit_set_periodic,
+    .set_oneshot = pit_set_oneshot,
+    .elapsed = pit_elapsed,
+    .expired = pit_expired,
+};
+
+static void pit_irq(struct trap_frame *tf) {
+    clockevent_handle_irq();   // advance jiffies, run expired timers
+}
+
+void pit_clockevent_init(void) {
+    pit_divisor = (PIT_FREQUENCY + HZ / 2) / HZ;
+    pit_clockevent.counts_per_tick = pit_divisor;
+    pit_clockevent.max_counts = 0xFFFF;
+    clockevent_register(&pit_clockevent);
+    register_irq_handler(0, pit_irq);
+}
+
+/* ===== Tick handling ===== */
+
+void clockevent_register(struct clock_event_device *dev) {
+    uint32_t flags = irq_save();
+    tick_dev = dev;
+    nohz_armed = 0;
+    carry = 0;
+    dev->set_periodic();
+    irq_restore(flags);
+}
+
+struct clock_event_device *clockevent_current(void) {
+    return tick_dev;
+}
+
+void clockevent_handle_irq(void) {
+    if (swallow_irq) {
+        swallow_irq = 0;
+        return;
+    }
+    uint32_t ticks = 1;
+    if (nohz_armed && tick_dev->expired()) {
+        // The one-shot ended exactly on a jiffy boundary
+        ticks = nohz_ticks;
+        nohz_armed = 0;
+        carry = 0;
+    }
+    // Otherwise, with a one-shot armed, this is a periodic tick that was
+    // already latched when nohz_enter() ran: one real jiffy that start
+    // didn't include. The one-shot stays armed; the time since arming is
+    // still nohz_start + elapsed(), which nohz_exit() turns into carry.
+    timer_advance(ticks);
+    sched_tick();
+}
+
+// Interrupts off. Stops the periodic tick until the next timer is due.
+static void nohz_enter(void) {
+    struct clock_event_device *dev = tick_dev;
+    if (!dev || !dev->set_oneshot)
+        return;
+    int32_t cpt = dev->counts_per_tick;
+
+    // A whole jiffy may have built up from carry and the current period
+    int32_t start = carry + (int32_t)dev->elapsed();
+    if (start >= cpt) {
+        carry -= cpt;
+        start -= cpt;
+        timer_advance(1);
+    }
+
+    uint32_t max = (dev->max_counts + start) / cpt;   // longest one-shot, in jiffies
+    uint32_t next, delta = max;
+    if (timer_next_expiry(&next)) {
+        delta = next - jiffies;
+        if ((int32_t)delta <= 1)
+            return;   // due by the next periodic tick anyway
+        if (delta > max)
+            delta = max;
+    }
+    if (delta <= 1)
+        return;
+
+    // End on a jiffy boundary: the part already elapsed counts towards it
+    dev->set_oneshot(delta * cpt - start);
+    nohz_armed = 1;
+    nohz_ticks = delta;
+    nohz_start = start;
+    carry = 0;
+    nohz_entries++;
+}
+
+// Interrupts off. Catches jiffies up and restarts the periodic tick.
+static void nohz_exit(void) {
+    struct clock_event_device *dev = tick_dev;
+    uint32_t ticks;
+    if (!nohz_armed) {
+        // Either still periodic, or the one-shot's interrupt was handled
+        if (dev && nohz_ticks) {
+            nohz_ticks = 0;
+            dev->set_periodic();
+        }
+        return;
+    }
+
+    nohz_armed = 0;
+    if (dev->expired()) {
+        // Fired, but its interrupt is still pending behind this one
+        ticks = nohz_ticks;
+        carry = 0;
+        swallow_irq = 1;
+    } else {
+        // Woken early by another interrupt
+        int32_t total = nohz_start + (int32_t)dev->elapsed();
+        ticks = 0;
+        if (total > 0) {
+            ticks = total / dev->counts_per_tick;
+            total -= ticks * dev->counts_per_tick;
+        }
+        carry = total;
+    }
+    nohz_ticks = 0;
+    dev->set_periodic();
+    if (ticks)
+        timer_advance(ticks);
+}
+
+void cpu_idle(void) {
+    // Deferred work first; the caller rechecks its condition afterwards
+    if (tasklets_pending()) {
+        run_tasklets();
+        return;
+    }
+    idle_entries++;
+    nohz_enter();
+    if (!tasklets_pending()) {   // nohz_enter() may have caught jiffies up
+        // sti takes effect after hlt starts, so no interrupt can be missed
+        __asm__ __volatile__("sti\n\thlt\n\tcli" ::: "memory");
+    }
+    nohz_exit();
+}
@@ -0,0 +1,47 @@
+#ifndef CLOCKEVENT_H
+#define CLOCKEVENT_H
+
+#include <stdint.h>
+
+/* ===== Tick devices and tickless idle =====
+   A clock event device raises the timer interrupt, either periodically at
+   HZ or once after a given number of ticks. While the CPU is busy the tick
+   is periodic. When it goes idle, cpu_idle() looks up the next pending
+   timer and arms a single interrupt for then (capped at the device's
+   max_ticks) so no ticks fire while the CPU sits in hlt. jiffies is caught
+   up on wakeup, whether the one-shot fired or another interrupt came
+   first. */
+
+struct clock_event_device {
+    const char *name;
+    uint32_t counts_per_tick;             // device counts in one jiffy
+    uint32_t max_counts;                  // longest one-shot (>= counts_per_tick)
+    void (*set_periodic)(void);           // one interrupt per jiffy
+    void (*set_oneshot)(uint32_t counts); // one interrupt after counts
+    uint32_t (*elapsed)(void);            // counts since the last periodic
+                                          // interrupt or set_oneshot()
+    int (*expired)(void);                 // nonzero once the one-shot has fired
+};
+
+// Makes dev the tick device and starts it in periodic mode. Replaces the
+// current one (e.g. the local APIC timer taking over from the PIT).
+void clockevent_register(struct clock_event_device *dev);
+
+// The current tick device, or NULL
+struct clock_event_device *clockevent_current(void);
+
+// Called by the tick device's interrupt handler (before EOI)
+void clockevent_handle_irq(void);
+
+// Programs the PIT as the tick device and hooks IRQ0
+void pit_clockevent_init(void);
+
+// Runs pending tasklets, or else sleeps until the next interrupt with the
+// tick stopped if nothing is due soon. Call with interrupts disabled after
+// finding no work; returns with interrupts disabled.
+void cpu_idle(void);
+
+// Idle statistics: hlt entries, and how many of them ran tickless
+extern uint32_t idle_entries, nohz_entries;
+
+#endif // CLOCKEVENT_H
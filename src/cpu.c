@@ -0,0 +1,41 @@
+#include "cpu.h"
+
+static int features_valid = 0;
+static uint32_t features_edx = 0;
+
+/* CPUID exists if software can flip EFLAGS.ID (bit 21). */
+static int have_cpuid(void) {
+    uint32_t before, after;
+    __asm__ __volatile__(
+        "pushfl\n"
+        "pop  %0\n"
+        "mov  %0, %1\n"
+        "xor  $0x200000, %1\n"
+        "push %1\n"
+        "popfl\n"
+        "pushfl\n"
+        "pop  %1\n"
+        "push %0\n"
+        "popfl\n"
+        : "=&r"(before), "=&r"(after) :: "cc");
+    return ((before ^ after) & 0x200000) != 0;
+}
+
+int cpuid(uint32_t leaf, struct cpuid_regs *regs) {
+    if (!have_cpuid())
+        return 0;
+    __asm__ __volatile__("cpuid"
+                         : "=a"(regs->eax), "=b"(regs->ebx), "=c"(regs->ecx), "=d"(regs->edx)
+                         : "a"(leaf), "c"(0));
+    return 1;
+}
+
+int cpu_has(uint32_t mask) {
+    if (!features_valid) {
+        struct cpuid_regs r;
+        if (cpuid(0, &r) && r.eax >= 1 && cpuid(1, &r))
+            features_edx = r.edx;
+        features_valid = 1;
+    }
+    return (features_edx & mask) == mask;
+}
@@ -0,0 +1,76 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+/* CPUID leaf 1 EDX feature bits */
+#define CPU_FEATURE_FPU   (1u << 0)    // x87 FPU on chip
+#define CPU_FEATURE_PSE   (1u << 3)    // 4 MiB pages
+#define CPU_FEATURE_TSC   (1u << 4)    // RDTSC
+#define CPU_FEATURE_MSR   (1u << 5)    // RDMSR/WRMSR
+#define CPU_FEATURE_APIC  (1u << 9)    // on-chip local APIC
+#define CPU_FEATURE_SEP   (1u << 11)   // SYSENTER/SYSEXIT
+#define CPU_FEATURE_FXSR  (1u << 24)   // FXSAVE/FXRSTOR
+#define CPU_FEATURE_SSE   (1u << 25)
+
+/* Model-specific registers */
+#define MSR_APIC_BASE     0x1B
+#define MSR_SYSENTER_CS   0x174
+#define MSR_SYSENTER_ESP  0x175
+#define MSR_SYSENTER_EIP  0x176
+
+/* Control register bits */
+#define CR0_MP    (1u << 1)    // WAIT/FWAIT honours TS
+#define CR0_EM    (1u << 2)    // emulate x87 (trap every FPU instruction)
+#define CR0_TS    (1u << 3)    // task switched: next FPU/SSE use raises #NM
+#define CR0_NE    (1u << 5)    // native x87 error reporting (#MF)
+#define CR4_PSE   (1u << 4)
+#define CR4_OSFXSR     (1u << 9)    // FXSAVE/FXRSTOR and SSE enabled
+#define CR4_OSXMMEXCPT (1u << 10)   // unmasked SSE exceptions raise #XM
+
+struct cpuid_regs {
+    uint32_t eax, ebx, ecx, edx;
+};
+
+// Runs CPUID for the given leaf. Returns 0 if the CPU has no CPUID.
+int cpuid(uint32_t leaf, struct cpuid_regs *regs);
+
+// Nonzero if every bit in mask is set in CPUID leaf 1 EDX (cached)
+int cpu_has(uint32_t mask);
+
+static inline uint32_t read_cr0(void) {
+    uint32_t v;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(uint32_t v) {
+    __asm__ __volatile__("mov %0, %%cr0" :: "r"(v) : "memory");
+}
+
+// Clears CR0.TS without a read-modify-write of CR0
+static inline void clts(void) {
+    __asm__ __volatile__("clts" ::: "memory");
+}
+
+static inline uint32_t read_cr4(void) {
+    uint32_t v;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(uint32_t v) {
+    __asm__ __volatile__("mov %0, %%cr4" :: "r"(v) : "memory");
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint64_t v;
+    __asm__ __volatile__("rdmsr" : "=A"(v) : "c"(msr));
+    return v;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t v) {
+    __asm__ __volatile__("wrmsr" :: "c"(msr), "A"(v) : "memory");
+}
+
+#endif // CPU_H
@@ -0,0 +1,90 @@
+#include "fpu.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "rprintf.h"
+#include "kmalloc.h"
+
+int putc(int ch);
+
+struct fpu_ctx fpu_boot_ctx = { 0 };
+uint32_t fpu_traps = 0, fpu_saves = 0, fpu_restores = 0;
+
+static struct kmem_cache *state_cache = 0;
+static int use_fxsr = 0;
+static struct fpu_ctx *current = &fpu_boot_ctx;
+static struct fpu_ctx *owner = 0;     // whose registers the FPU holds
+static struct fpu_state init_state;   // registers right after FNINIT
+
+static void save(struct fpu_state *s) {
+    if (use_fxsr)
+        __asm__ __volatile__("fxsave %0" : "=m"(*s));
+    else
+        __asm__ __volatile__("fnsave %0\n\tfwait" : "=m"(*s));   // fnsave also reinitialises
+}
+
+static void restore(const struct fpu_state *s) {
+    if (use_fxsr)
+        __asm__ __volatile__("fxrstor %0" :: "m"(*s));
+    else
+        __asm__ __volatile__("frstor %0" :: "m"(*s));
+}
+
+// #NM: the current context touched the FPU while TS was set
+static void fpu_nm_handler(struct trap_frame *tf) {
+    clts();
+    fpu_traps++;
+    if (owner == current)
+        return;
+    if (!current->state) {
+        current->state = kmem_cache_alloc(state_cache);
+        if (!current->state) {
+            esp_printf(putc, "No memory for FPU state (eip 0x%08x)\n", tf->eip);
+            while(1);
+        }
+        *current->state = init_state;
+    }
+    if (owner && owner->state) {
+        save(owner->state);
+        fpu_saves++;
+    }
+    restore(current->state);
+    fpu_restores++;
+    owner = current;
+}
+
+int fpu_init(void) {
+    if (!cpu_has(CPU_FEATURE_FPU))
+        return -1;
+    state_cache = kmem_cache_create("fpu_state", sizeof(struct fpu_state), 16);
+    if (!state_cache)
+        return -1;
+    use_fxsr = cpu_has(CPU_FEATURE_FXSR);
+    if (use_fxsr)
+        write_cr4(read_cr4() | CR4_OSFXSR | (cpu_has(CPU_FEATURE_SSE) ? CR4_OSXMMEXCPT : 0));
+    write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+
+    __asm__ __volatile__("fninit");
+    save(&init_state);
+    register_interrupt_handler(7, fpu_nm_handler);
+    write_cr0(read_cr0() | CR0_TS);   // nobody owns the FPU yet
+    return 0;
+}
+
+void fpu_switch(struct fpu_ctx *ctx) {
+    current = ctx;
+    if (owner == ctx && ctx->state)
+        clts();
+    else
+        write_cr0(read_cr0() | CR0_TS);
+}
+
+void fpu_release(struct fpu_ctx *ctx) {
+    uint32_t flags = irq_save();
+    if (owner == ctx)
+        owner = 0;
+    if (ctx->state) {
+        kmem_cache_free(state_cache, ctx->state);
+        ctx->state = 0;
+    }
+    irq_restore(flags);
+}
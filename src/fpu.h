@@ -0,0 +1,49 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+
+/* ===== Lazy FPU/SSE context switching =====
+   The FPU registers are not saved or restored on a context switch.
+   fpu_switch() only sets CR0.TS. The first FPU or SSE instruction the new
+   context executes then raises #NM (vector 7). The handler saves the
+   registers into the context that last used them, then loads the current
+   context's own state. That state is allocated from a slab cache the
+   first time the context touches the FPU, starting from FNINIT defaults.
+   A context that never uses floating point costs nothing beyond the TS
+   write.
+
+   The kernel itself is built with -mgeneral-regs-only, so only code that
+   deliberately uses FPU instructions (user tasks, test code) takes the
+   trap. FXSAVE/FXRSTOR (x87 + SSE) are used when the CPU has them, and
+   FNSAVE/FRSTOR (x87 only) otherwise. */
+
+#define FPU_STATE_SIZE 512   // FXSAVE area; FNSAVE needs 108 bytes
+
+struct fpu_state {
+    uint8_t area[FPU_STATE_SIZE];
+} __attribute__((aligned(16)));
+
+// Per-task FPU context: embed one in each task
+struct fpu_ctx {
+    struct fpu_state *state;   // NULL until the task first uses the FPU
+};
+
+// Detects the FPU, enables SSE state (CR4.OSFXSR) if present, and hooks
+// #NM. Call after init_idt() and kmalloc_init(). Returns -1 without an FPU.
+int fpu_init(void);
+
+// Makes ctx the current context. Sets CR0.TS unless the FPU still holds
+// ctx's registers. Call with interrupts disabled, as part of a switch.
+void fpu_switch(struct fpu_ctx *ctx);
+
+// Drops ctx's saved state (e.g. when its task exits)
+void fpu_release(struct fpu_ctx *ctx);
+
+// Context of the code that was running before any fpu_switch()
+extern struct fpu_ctx fpu_boot_ctx;
+
+// Statistics: #NM traps, and saves/restores they did
+extern uint32_t fpu_traps, fpu_saves, fpu_restores;
+
+#endif // FPU_H
@@ -28,7 +28,7 @@ int fd = 0;
    Reads one sector from a disk image. Assumes global variable fd represents an
    open file descriptor for the disk image.
 
-   This is a Linux implementation of ata_lba_read(), which is provided in ide.s,
+   This is a Linux implementation of ata_lba_read(), which is provided in ide.c,
    that reads from disk by directly accessing the hardware ATA controller. Since
    we're experimenting with disk images in Linux, we don't want to directly
    access the ATA controller.
@@ -0,0 +1,515 @@
+#include "ide.h"
+#include "interrupt.h"
+#include "sched.h"
+#include "timer.h"
+#include "tsc.h"
+#include "pci.h"
+#include "paging.h"
+
+void outb(uint16_t _port, uint8_t val);
+uint8_t inb(uint16_t _port);
+
+/* Primary channel registers */
+#define ATA_DATA     0x1F0
+#define ATA_ERROR    0x1F1
+#define ATA_COUNT    0x1F2
+#define ATA_LBA_LO   0x1F3
+#define ATA_LBA_MID  0x1F4
+#define ATA_LBA_HI   0x1F5
+#define ATA_DRIVE    0x1F6      /* 0xE0 | LBA bits 24-27: master, LBA mode */
+#define ATA_STATUS   0x1F7      /* read: status (acknowledges the IRQ) */
+#define ATA_COMMAND  0x1F7      /* write: command */
+#define ATA_ALTSTAT  0x3F6      /* read: status without acknowledging */
+#define ATA_CONTROL  0x3F6      /* write: bit 1 nIEN, bit 2 SRST */
+
+#define ATA_IRQ      14
+
+#define ST_ERR  0x01
+#define ST_DRQ  0x08
+#define ST_DF   0x20
+#define ST_BSY  0x80
+
+#define CTL_NIEN 0x02
+#define CTL_SRST 0x04
+
+#define CMD_READ_SECTORS     0x20
+#define CMD_READ_SECTORS_EXT 0x24
+#define CMD_READ_DMA_EXT     0x25
+#define CMD_READ_MULTIPLE_EXT 0x29
+#define CMD_WRITE_SECTORS    0x30
+#define CMD_WRITE_SECTORS_EXT 0x34
+#define CMD_WRITE_DMA_EXT    0x35
+#define CMD_WRITE_MULTIPLE_EXT 0x39
+#define CMD_READ_MULTIPLE    0xC4
+#define CMD_WRITE_MULTIPLE   0xC5
+#define CMD_SET_MULTIPLE     0xC6
+#define CMD_READ_DMA         0xC8
+#define CMD_WRITE_DMA        0xCA
+#define CMD_FLUSH_CACHE      0xE7
+#define CMD_FLUSH_CACHE_EXT  0xEA
+#define CMD_IDENTIFY         0xEC
+
+#define LBA28_LIMIT   (1u << 28)
+#define LBA28_MAX_SECTORS 256u
+#define LBA48_MAX_SECTORS 65536u
+/* Per DMA command: keeps the PRD table within its page even if every
+   4 KiB page of the buffer is physically apart */
+#define DMA_MAX_SECTORS 2048u
+
+/* Bus-master IDE registers (primary channel), at BAR4 of the controller */
+#define BM_COMMAND   0x0        /* bit 0 start, bit 3 direction */
+#define BM_STATUS    0x2        /* bits 1/2 are cleared by writing 1 */
+#define BM_PRDT      0x4        /* physical address of the PRD table */
+
+#define BM_CMD_START   0x01
+#define BM_CMD_TO_MEM  0x08     /* device -> memory (a read) */
+#define BM_ST_ACTIVE   0x01
+#define BM_ST_ERR      0x02
+#define BM_ST_IRQ      0x04
+
+/* Physical Region Descriptor: one physically contiguous piece of the
+   buffer, not crossing a 64 KiB boundary */
+struct prd {
+    uint32_t addr;
+    uint16_t count;             // bytes, 0 means 64 KiB
+    uint16_t flags;
+} __attribute__((packed));
+
+#define PRD_EOT    0x8000       /* last entry of the table */
+#define PRD_MAX    (PAGE_SIZE / sizeof(struct prd))
+#define PRD_64K    0x10000u
+
+uint32_t ata_commands = 0, ata_dma_commands = 0, ata_irqs = 0, ata_timeouts = 0, ata_flushes = 0;
+
+static int present = 0;
+static struct ata_info info;
+static uint16_t bm_base = 0;    // 0: no bus-master controller
+static int use_dma = 0;
+static struct prd *prdt;        // one identity-mapped page frame
+
+/* The request in flight. Only the IRQ handler touches it while
+   remaining > 0; the issuing thread sleeps on done_wq until then. */
+static struct {
+    uint16_t *buf;
+    volatile uint32_t remaining;   // sectors still to transfer (1 for DMA and FLUSH)
+    uint32_t block;                // sectors per DRQ interrupt (PIO)
+    uint32_t inflight;             // PIO write: sectors sent, not yet acknowledged
+    volatile int error;
+    int dma;
+    int write;
+    int nodata;                    // no data phase: the first IRQ completes it
+} req;
+
+static struct wait_queue done_wq;      // the issuer, waiting for completion
+static struct wait_queue channel_wq;   // threads waiting for the channel
+static int channel_busy = 0;
+
+static inline void outl(uint16_t port, uint32_t v) {
+    __asm__ __volatile__("outl %0, %1" :: "a"(v), "dN"(port));
+}
+
+static inline void insw(uint16_t port, void *buf, uint32_t words) {
+    __asm__ __volatile__("cld; rep insw" : "+D"(buf), "+c"(words) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void *buf, uint32_t words) {
+    __asm__ __volatile__("cld; rep outsw" : "+S"(buf), "+c"(words) : "d"(port) : "memory");
+}
+
+// The 400 ns the drive may take to update status after a write
+static void ata_delay(void) {
+    for (int i = 0; i < 4; i++)
+        inb(ATA_ALTSTAT);
+}
+
+// Polls for BSY to clear, for command setup and resets only (normally
+// immediate). Timed with ktime_ns() so it works with interrupts off.
+// Returns the status, or -1 after ms milliseconds.
+static int wait_not_busy(uint32_t ms) {
+    uint64_t until = ktime_ns() + (uint64_t)ms * 1000000u;
+    for (;;) {
+        uint8_t st = inb(ATA_ALTSTAT);
+        if (!(st & ST_BSY))
+            return st;
+        if (ktime_ns() > until)
+            return -1;
+    }
+}
+
+static void ata_reset(void) {
+    outb(ATA_CONTROL, CTL_SRST);
+    for (int i = 0; i < 4; i++)
+        ata_delay();                // SRST must be held for 5 us
+    outb(ATA_CONTROL, 0);
+    wait_not_busy(ATA_TIMEOUT_MS);
+}
+
+// DMA completion: stop the engine and collect both status registers
+static void dma_irq(void) {
+    uint8_t bst = inb(bm_base + BM_STATUS);
+    uint8_t st = inb(ATA_STATUS);   // acknowledges the interrupt
+    if (!(bst & BM_ST_IRQ) || !req.remaining)
+        return;                     // not ours, or a late one after a timeout
+    outb(bm_base + BM_COMMAND, 0);
+    outb(bm_base + BM_STATUS, BM_ST_IRQ | BM_ST_ERR);
+    if ((st & (ST_ERR | ST_DF)) || (bst & BM_ST_ERR))
+        req.error = ATA_ERR_DEVICE;
+    req.remaining = 0;
+    wake_up(&done_wq);
+}
+
+// PIO write: the next DRQ block goes out of the data port
+static void send_block(void) {
+    uint32_t n = req.remaining < req.block ? req.remaining : req.block;
+    outsw(ATA_DATA, req.buf, n * ATA_SECTOR_SIZE / 2);
+    req.buf += n * ATA_SECTOR_SIZE / 2;
+    req.inflight = n;
+}
+
+static void ata_irq(struct trap_frame *tf) {
+    ata_irqs++;
+    if (req.dma) {
+        dma_irq();
+        return;
+    }
+    uint8_t st = inb(ATA_STATUS);   // acknowledges the interrupt
+    if (!req.remaining)
+        return;                     // not ours, or a late one after a timeout
+    if (st & (ST_ERR | ST_DF)) {
+        req.error = ATA_ERR_DEVICE;
+        req.remaining = 0;
+    } else if (st & ST_BSY) {
+        return;                     // the next IRQ will say
+    } else if (req.nodata) {
+        req.remaining = 0;
+    } else if (req.write) {
+        // The block sent last is on the drive; DRQ asks for the next one
+        req.remaining -= req.inflight;
+        req.inflight = 0;
+        if (req.remaining) {
+            if (st & ST_DRQ) {
+                send_block();
+            } else {
+                req.error = ATA_ERR_DEVICE;
+                req.remaining = 0;
+            }
+        }
+    } else if (st & ST_DRQ) {
+        // One block: `block` sectors, or what is left of the request
+        uint32_t n = req.remaining < req.block ? req.remaining : req.block;
+        insw(ATA_DATA, req.buf, n * ATA_SECTOR_SIZE / 2);
+        req.buf += n * ATA_SECTOR_SIZE / 2;
+        req.remaining -= n;
+    } else {
+        return;
+    }
+    if (!req.remaining)
+        wake_up(&done_wq);
+}
+
+// Describes [buf, buf + bytes) in prdt, one entry per physically
+// contiguous run. Returns -1 if a page isn't mapped or the table is full.
+static int build_prdt(const void *buf, uint32_t bytes) {
+    uint32_t va = (uint32_t)buf, n = 0;
+    while (bytes) {
+        uint32_t chunk = PAGE_SIZE - (va & (PAGE_SIZE - 1));
+        if (chunk > bytes)
+            chunk = bytes;
+        uint32_t pa = (uint32_t)get_physaddr((void *)va);
+        if (!pa)
+            return -1;
+        // Pages never straddle a 64 KiB boundary, so a run only has to be
+        // cut where one ends
+        struct prd *last = n ? &prdt[n - 1] : 0;
+        uint32_t last_len = last ? (last->count ? last->count : PRD_64K) : 0;
+        if (last && last->addr + last_len == pa && (pa & (PRD_64K - 1)) != 0) {
+            last->count = last_len + chunk;   // 64 KiB wraps to 0, as it should
+        } else {
+            if (n == PRD_MAX)
+                return -1;
+            prdt[n].addr = pa;
+            prdt[n].count = chunk;
+            prdt[n].flags = 0;
+            n++;
+        }
+        va += chunk;
+        bytes -= chunk;
+    }
+    prdt[n - 1].flags = PRD_EOT;
+    return 0;
+}
+
+// Sleeps until the IRQ handler finishes the request; interrupts off.
+// Where the caller can't block (before the scheduler runs, or in a
+// tasklet) it halts until the next interrupt instead.
+static int wait_done(uint32_t ms) {
+    uint32_t timeout = msecs_to_jiffies(ms) + 1;
+    uint32_t left = req.remaining;
+    uint32_t deadline = jiffies + timeout;
+    while (req.remaining) {
+        if (sched_can_block()) {
+            wait_on_timeout(&done_wq, timeout);
+        } else {
+            __asm__ __volatile__("sti; hlt; cli" ::: "memory");
+        }
+        if (req.remaining != left) {
+            // Progress: the timeout is per DRQ block
+            left = req.remaining;
+            deadline = jiffies + timeout;
+        } else if (req.remaining && time_after_eq(jiffies, deadline)) {
+            req.remaining = 0;
+            ata_timeouts++;
+            ata_reset();
+            return ATA_ERR_TIMEOUT;
+        }
+    }
+    return req.error;
+}
+
+static void channel_lock(void) {
+    uint32_t flags = irq_save();
+    while (channel_busy)
+        wait_on(&channel_wq);
+    channel_busy = 1;
+    irq_restore(flags);
+}
+
+static void channel_unlock(void) {
+    channel_busy = 0;
+    wake_up(&channel_wq);
+}
+
+// Copies an IDENTIFY string (byte-swapped words) and trims the padding
+static void id_string(char *out, const uint16_t *id, int first, int words) {
+    int len = 0;
+    for (int i = 0; i < words; i++) {
+        out[len++] = id[first + i] >> 8;
+        out[len++] = id[first + i] & 0xFF;
+    }
+    while (len > 0 && out[len - 1] == ' ')
+        len--;
+    out[len] = 0;
+}
+
+// Polled, with the drive's interrupt disabled (init time only)
+static int identify(void) {
+    static uint16_t id[256];
+    outb(ATA_COMMAND, CMD_IDENTIFY);
+    ata_delay();
+    int st = wait_not_busy(ATA_TIMEOUT_MS);
+    if (st < 0 || (st & ST_ERR) || !(st & ST_DRQ))
+        return -1;                  // ATAPI or no drive
+    insw(ATA_DATA, id, 256);
+
+    info.lba48 = (id[83] & (1u << 10)) != 0;
+    if (info.lba48)
+        info.sectors = id[100] | (uint32_t)id[101] << 16 | (uint64_t)id[102] << 32 | (uint64_t)id[103] << 48;
+    else
+        info.sectors = id[60] | (uint32_t)id[61] << 16;
+    id_string(info.model, id, 27, 20);
+
+    // READ MULTIPLE block size: the largest the drive allows (word 47)
+    uint32_t max_block = id[47] & 0xFF;
+    info.multiple = 1;
+    if (max_block > 1) {
+        outb(ATA_COUNT, max_block);
+        outb(ATA_COMMAND, CMD_SET_MULTIPLE);
+        ata_delay();
+        st = wait_not_busy(ATA_TIMEOUT_MS);
+        if (st >= 0 && !(st & ST_ERR))
+            info.multiple = max_block;
+    }
+    return 0;
+}
+
+int ide_init(void) {
+    outb(ATA_DRIVE, 0xE0);
+    ata_delay();
+    uint8_t st = inb(ATA_ALTSTAT);
+    if (st == 0xFF || st == 0x00)
+        return -1;                  // floating bus or no drive
+    if (wait_not_busy(ATA_TIMEOUT_MS) < 0)
+        return -1;
+    outb(ATA_CONTROL, CTL_NIEN);
+    if (identify() < 0)
+        return -1;
+    register_irq_handler(ATA_IRQ, ata_irq);
+    outb(ATA_CONTROL, 0);           // nIEN clear: interrupts on
+    present = 1;
+
+    // Bus mastering, if the controller can and its primary channel is at
+    // the legacy ports (prog-if bit 0 clear) where the code above looked
+    struct pci_dev dev;
+    if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &dev) == 0 &&
+        (dev.prog_if & 0x80) && !(dev.prog_if & 0x01)) {
+        uint32_t bar4 = pci_bar(&dev, 4);
+        prdt = pfa_alloc_frames(0);
+        if (bar4 && bar4 < 0x10000 && prdt) {
+            pci_enable(&dev, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+            bm_base = bar4;
+            use_dma = 1;
+        }
+    }
+    return 0;
+}
+
+int ide_set_dma(int on) {
+    use_dma = on && bm_base;
+    return use_dma;
+}
+
+const struct ata_info *ata_info(void) {
+    return present ? &info : 0;
+}
+
+// Loads the taskfile and starts cmd. ext: 48-bit form, where the high
+// ("previous") bytes of the count and LBA go in first.
+static void issue(uint8_t cmd, uint64_t lba, uint32_t count, int ext) {
+    if (ext) {
+        outb(ATA_DRIVE, 0x40);                // LBA mode, master
+        outb(ATA_COUNT, (count >> 8) & 0xFF);  // 65536 is sent as 0
+        outb(ATA_LBA_LO, (lba >> 24) & 0xFF);
+        outb(ATA_LBA_MID, (lba >> 32) & 0xFF);
+        outb(ATA_LBA_HI, (lba >> 40) & 0xFF);
+    } else {
+        outb(ATA_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
+    }
+    outb(ATA_COUNT, count & 0xFF);            // 256 is sent as 0
+    outb(ATA_LBA_LO, lba & 0xFF);
+    outb(ATA_LBA_MID, (lba >> 8) & 0xFF);
+    outb(ATA_LBA_HI, (lba >> 16) & 0xFF);
+    outb(ATA_COMMAND, cmd);
+    ata_commands++;
+}
+
+// PIO write: the drive asks for the first block with DRQ but no
+// interrupt, so that one is polled for
+static int pio_write(uint8_t cmd, uint64_t lba, uint32_t count, int ext) {
+    issue(cmd, lba, count, ext);
+    ata_delay();
+    int st = wait_not_busy(ATA_TIMEOUT_MS);
+    if (st < 0) {
+        ata_timeouts++;
+        ata_reset();
+        return ATA_ERR_TIMEOUT;
+    }
+    if ((st & (ST_ERR | ST_DF)) || !(st & ST_DRQ))
+        return ATA_ERR_DEVICE;
+    send_block();
+    return wait_done(ATA_TIMEOUT_MS);
+}
+
+// Runs one command on the locked channel: by DMA if dma is set, else by
+// PIO (READ/WRITE MULTIPLE when a block size was set). Interrupts off.
+static int transfer(uint64_t lba, void *buffer, uint32_t count, int write, int dma) {
+    int ext = lba + count > LBA28_LIMIT || count > LBA28_MAX_SECTORS;
+    req.buf = buffer;
+    req.error = 0;
+    req.dma = dma;
+    req.write = write;
+    req.nodata = 0;
+    if (!dma) {
+        req.remaining = count;
+        req.block = info.multiple;
+        req.inflight = 0;
+        int multi = info.multiple > 1;
+        if (write)
+            return pio_write(multi ? (ext ? CMD_WRITE_MULTIPLE_EXT : CMD_WRITE_MULTIPLE)
+                                   : (ext ? CMD_WRITE_SECTORS_EXT : CMD_WRITE_SECTORS),
+                             lba, count, ext);
+        issue(multi ? (ext ? CMD_READ_MULTIPLE_EXT : CMD_READ_MULTIPLE)
+                    : (ext ? CMD_READ_SECTORS_EXT : CMD_READ_SECTORS), lba, count, ext);
+        return wait_done(ATA_TIMEOUT_MS);
+    }
+
+    if (build_prdt(buffer, count * ATA_SECTOR_SIZE) < 0)
+        return ATA_ERR_DEVICE;
+    req.remaining = 1;
+    outb(bm_base + BM_COMMAND, 0);
+    outb(bm_base + BM_STATUS, BM_ST_IRQ | BM_ST_ERR);
+    outl(bm_base + BM_PRDT, (uint32_t)get_physaddr(prdt));
+    uint8_t dir = write ? 0 : BM_CMD_TO_MEM;
+    outb(bm_base + BM_COMMAND, dir);
+    if (write)
+        issue(ext ? CMD_WRITE_DMA_EXT : CMD_WRITE_DMA, lba, count, ext);
+    else
+        issue(ext ? CMD_READ_DMA_EXT : CMD_READ_DMA, lba, count, ext);
+    ata_dma_commands++;
+    outb(bm_base + BM_COMMAND, dir | BM_CMD_START);
+    int ret = wait_done(ATA_TIMEOUT_MS);
+    if (ret == ATA_ERR_TIMEOUT)
+        outb(bm_base + BM_COMMAND, 0);
+    return ret;
+}
+
+// Splits a request at what one command can carry: 256 sectors without
+// LBA48, 65536 with it, and DMA_MAX_SECTORS for the PRD table. The
+// channel is released between commands so other requests can interleave.
+static int ata_rw(uint64_t lba, void *buffer, uint32_t count, int write) {
+    if (!present || count == 0 || lba + count > info.sectors || lba + count < lba)
+        return ATA_ERR_DEVICE;
+    if (!info.lba48 && lba + count > LBA28_LIMIT)
+        return ATA_ERR_DEVICE;
+    // The controller moves whole words
+    int dma = use_dma && !((uint32_t)buffer & 1);
+    uint32_t max = info.lba48 ? LBA48_MAX_SECTORS : LBA28_MAX_SECTORS;
+    if (dma && max > DMA_MAX_SECTORS)
+        max = DMA_MAX_SECTORS;
+
+    uint8_t *p = buffer;
+    while (count) {
+        uint32_t n = count < max ? count : max;
+        channel_lock();
+        int ret = ATA_ERR_TIMEOUT;
+        if (wait_not_busy(ATA_TIMEOUT_MS) >= 0) {
+            uint32_t flags = irq_save();
+            ret = transfer(lba, p, n, write, dma);
+            irq_restore(flags);
+        }
+        channel_unlock();
+        if (ret < 0)
+            return ret;
+        lba += n;
+        p += n * ATA_SECTOR_SIZE;
+        count -= n;
+    }
+    return 0;
+}
+
+int ata_read(uint64_t lba, void *buffer, uint32_t count) {
+    return ata_rw(lba, buffer, count, 0);
+}
+
+int ata_write(uint64_t lba, const void *buffer, uint32_t count) {
+    return ata_rw(lba, (void *)buffer, count, 1);
+}
+
+int ata_flush(void) {
+    if (!present)
+        return ATA_ERR_DEVICE;
+    channel_lock();
+    int ret = ATA_ERR_TIMEOUT;
+    if (wait_not_busy(ATA_TIMEOUT_MS) >= 0) {
+        uint32_t flags = irq_save();
+        req.error = 0;
+        req.dma = 0;
+        req.write = 0;
+        req.nodata = 1;
+        req.remaining = 1;
+        issue(info.lba48 ? CMD_FLUSH_CACHE_EXT : CMD_FLUSH_CACHE, 0, 0, 0);
+        ret = wait_done(ATA_FLUSH_TIMEOUT_MS);
+        irq_restore(flags);
+    }
+    channel_unlock();
+    if (ret == 0)
+        ata_flushes++;
+    return ret;
+}
+
+int ata_lba_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors) {
+    return ata_read(lba, buffer, numsectors);
+}
+
+int ata_lba_write(unsigned int lba, const unsigned char *buffer, unsigned int numsectors) {
+    return ata_write(lba, buffer, numsectors);
+}
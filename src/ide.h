@@ -1,6 +1,71 @@
 #ifndef __IDE_H__
 #define __IDE_H__
 
+#include <stdint.h>
+
+/* ===== ATA disk on the primary IDE channel (master) =====
+   A request issues the command and then sleeps until IRQ14; other threads
+   run in the meantime.
+
+   When PCI has a bus-master IDE controller (PIIX and compatibles), data
+   moves by DMA: the buffer's pages are described by a Physical Region
+   Descriptor table, the controller copies the whole request to or from
+   memory, and IRQ14 fires once at the end. Otherwise, or for a buffer
+   that isn't word aligned, PIO with READ/WRITE MULTIPLE is used: IRQ14
+   fires once per DRQ block of ata_info()->multiple sectors and the handler
+   copies the block out of (or the next one into) the data port.
+
+   Drives with LBA48 get the EXT commands (16-bit sector counts, 48-bit
+   addresses) whenever a command needs them. Requests of any length are
+   split at the per-command limits.
+
+   A device that doesn't raise the next interrupt within ATA_TIMEOUT_MS is
+   reset and the request fails. Requests are serialised: one command is
+   outstanding on the channel at a time. */
+
+#define ATA_SECTOR_SIZE 512
+#define ATA_TIMEOUT_MS  2000
+#define ATA_FLUSH_TIMEOUT_MS 30000   // FLUSH CACHE may write out the whole drive cache
+
+#define ATA_ERR_DEVICE  -1   // the drive reported ERR/DF, or there is none
+#define ATA_ERR_TIMEOUT -2   // no interrupt within ATA_TIMEOUT_MS
+
+// Checks for a drive, looks for a bus-master controller on PCI and hooks
+// IRQ14. Call after interrupts and paging are set up. Returns 0 if a drive
+// answered.
+int ide_init(void);
+
+struct ata_info {
+    uint64_t sectors;             // capacity
+    int lba48;
+    uint32_t multiple;            // sectors per PIO DRQ block (1: no READ MULTIPLE)
+    char model[41];
+};
+
+// What IDENTIFY DEVICE reported, or NULL without a drive
+const struct ata_info *ata_info(void);
+
+// Turns DMA on or off (it is on after ide_init() if the controller has
+// it). Returns nonzero if DMA is now in use.
+int ide_set_dma(int on);
+
+// Reads count sectors starting at lba into buffer. Returns 0 on success
+// or an ATA_ERR_* code (also for a range past the end of the disk).
+int ata_read(uint64_t lba, void *buffer, uint32_t count);
+
+// Same, for the original 32-bit interface
 int ata_lba_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors);
 
+// Writes count sectors from buffer starting at lba. Returns 0 once the
+// drive has taken the data (it may still be in its write cache) or an
+// ATA_ERR_* code.
+int ata_write(uint64_t lba, const void *buffer, uint32_t count);
+int ata_lba_write(unsigned int lba, const unsigned char *buffer, unsigned int numsectors);
+
+// FLUSH CACHE: returns once everything written so far is on the medium
+int ata_flush(void);
+
+// Statistics: commands issued (DMA ones too), IRQs taken, timeouts, flushes
+extern uint32_t ata_commands, ata_dma_commands, ata_irqs, ata_timeouts, ata_flushes;
+
 #endif
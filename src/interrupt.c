@@ -21,6 +21,13 @@
 
 #include <stdint.h>
 #include "interrupt.h"
+#include "rprintf.h"
+#include "vm.h"
+#include "vmalloc.h"
+#include "paging.h"
+#include "tsc.h"
+#include "tasklet.h"
+#include "sched.h"
 
 struct idt_entry idt_entries[256];
 struct idt_ptr   idt_ptr;
@@ -38,6 +45,7 @@ void outb (uint16_t _port, uint8_t val) {
 }
 
 uint8_t inb (uint16_t _port);
+int putc(int ch);
 
 
 void memset(char *s, char c, unsigned int n) {
@@ -160,12 +168,12 @@ void load_gdt() {
         "lgdt [gdt_desc]\n"     // Load the new GDT
         "ljmp $0x8,$gdt_flush\n"   // Far jump to update the CS
 "gdt_flush:\n"
-        "mov %%eax, 0x10\n"       // set data segments to data selector (0x10)
-        "mov %%ds, %%eax\n"
-        "mov %%ss, %%eax\n"
-        "mov %%es, %%eax\n"
-        "mov %%fs, %%eax\n"
-        "mov %%gs, %%eax\n" : : : "eax");
+        "mov $0x10, %%eax\n"       // set data segments to data selector (0x10)
+        "mov %%eax, %%ds\n"
+        "mov %%eax, %%ss\n"
+        "mov %%eax, %%es\n"
+        "mov %%eax, %%fs\n"
+        "mov %%eax, %%gs\n" : : : "eax");
 
 }
 
@@ -175,7 +183,6 @@ void write_tss(struct gdt_entry_bits *g) {
     // Firstly, let's compute the base and limit of our entry into the GDT.
     uint32_t base = (uint32_t) &tss_ent;
     uint32_t limit = base + sizeof(struct tss_entry);
-    extern uint32_t stack_top;
 
     // Now, add our TSS descriptor's address to the GDT.
     g->limit_low = limit & 0xFFFF;
@@ -256,144 +263,253 @@ void idt_flush(struct idt_ptr *idt){
 }
 
 
-__attribute__((interrupt)) void divide_error_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-    while(1);
-}
+/* ===== Interrupt dispatch =====
+   Every vector enters through its stub in isr_stubs.S and ends up in
+   interrupt_dispatch() with a struct trap_frame. Handlers are looked up in
+   handlers[]; IRQs get their EOI from the current irq_chip after the handler
+   ran. */
 
-__attribute__((interrupt)) void debug_exception_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
-}
+static interrupt_handler_t handlers[IDT_SIZE];
+static struct interrupt_stats stats[IDT_SIZE];
+static uint32_t spurious_irqs;
+static struct irq_chip *irq_chip = &pic_chip;
 
-__attribute__((interrupt)) void breakpoint_exception_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
-}
+static const char *const exception_names[32] = {
+    "divide error", "debug", "NMI", "breakpoint", "overflow", "bound range",
+    "invalid opcode", "device not available", "double fault",
+    "coprocessor segment overrun", "invalid TSS", "segment not present",
+    "stack fault", "general protection", "page fault", "reserved",
+    "x87 error", "alignment check", "machine check", "SIMD error",
+    "virtualization", "control protection",
+};
 
-__attribute__((interrupt)) void overflow_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+int register_interrupt_handler(uint8_t vector, interrupt_handler_t handler) {
+    if (handler && handlers[vector])
+        return -1;   // already taken
+    handlers[vector] = handler;
+    return 0;
 }
 
-__attribute__((interrupt)) void bound_check_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+int register_irq_handler(uint8_t irq, interrupt_handler_t handler) {
+    if (irq >= 16 || register_interrupt_handler(IRQ_BASE + irq, handler) < 0)
+        return -1;
+    if (handler)
+        irq_chip->unmask(irq);
+    else
+        irq_chip->mask(irq);
+    return 0;
 }
 
-__attribute__((interrupt)) void invalid_opcode_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
-}
+/* ===== 8259 PIC as an irq_chip ===== */
 
-__attribute__((interrupt)) void coprocessor_not_available_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+static void pic_unmask(uint8_t irq) {
+    if (irq >= 8)
+        IRQ_clear_mask(2);   // cascade from the slave PIC
+    IRQ_clear_mask(irq);
 }
 
-__attribute__((interrupt)) void double_fault_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+static void pic_mask(uint8_t irq) {
+    IRQ_set_mask(irq);
 }
 
-
-__attribute__((interrupt)) void coprocessor_segment_overrun_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+static void pic_eoi(uint8_t vector) {
+    PIC_sendEOI(vector - IRQ_BASE);
 }
 
+struct irq_chip pic_chip = {
+    .name = "8259",
+    .mask = pic_mask,
+    .unmask = pic_unmask,
+    .eoi = pic_eoi,
+};
 
-__attribute__((interrupt)) void invalid_tss_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+void irq_set_chip(struct irq_chip *chip) {
+    uint32_t flags = irq_save();
+    for (uint8_t irq = 0; irq < 16; irq++) {
+        if (!handlers[IRQ_BASE + irq])
+            continue;
+        irq_chip->mask(irq);
+        chip->unmask(irq);
+    }
+    irq_chip = chip;
+    irq_restore(flags);
 }
 
-
-__attribute__((interrupt)) void segment_not_present_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+struct irq_chip *irq_get_chip(void) {
+    return irq_chip;
 }
 
-
-__attribute__((interrupt)) void stack_exception_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+// Read a PIC's in-service register
+static uint8_t pic_isr(uint16_t command_port) {
+    outb(command_port, 0x0B);   // OCW3: read ISR on next read
+    return inb(command_port);
 }
 
-
-//__attribute__((interrupt)) void general_protection_handler(struct interrupt_frame* frame)
-void general_protection_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-    while(1);
-}
-//void page_fault_handler(struct interrupt_frame* frame)
-void page_fault_handler(struct process_context_with_error* ctx)
-{
+static void unhandled_interrupt(struct trap_frame *tf) {
+    uint32_t v = tf->vector;
+    if (v == 1 || v == 3)
+        return;   // debug traps: nothing to do without a debugger
     asm("cli");
+    if (v < 32)
+        esp_printf(putc, "Exception %d (%s) at eip 0x%08x, error 0x%x\n",
+                   v, exception_names[v] ? exception_names[v] : "reserved", tf->eip, tf->err_code);
+    else
+        esp_printf(putc, "Unhandled interrupt %d at eip 0x%08x\n", v, tf->eip);
     while(1);
 }
 
+static inline uint32_t hist_bucket(uint64_t c) {
+    if (c >> 32)
+        return IRQ_HIST_BUCKETS - 1;
+    return (uint32_t)c ? 31 - __builtin_clz((uint32_t)c) : 0;
+}
+
+static void run_handler(struct trap_frame *tf, interrupt_handler_t handler) {
+    struct interrupt_stats *st = &stats[tf->vector];
+    uint64_t start = cycles();
+    handler(tf);
+    uint64_t spent = cycles() - start;
+
+    st->count++;
+    st->cycles += spent;
+    if (spent > st->max_cycles)
+        st->max_cycles = spent >> 32 ? 0xFFFFFFFFu : (uint32_t)spent;
+    st->duration_hist[hist_bucket(spent)]++;
+    if (tf->entry_tsc)
+        st->latency_hist[hist_bucket(start - tf->entry_tsc)]++;
+}
+
+void interrupt_dispatch(struct trap_frame *tf) {
+    uint32_t v = tf->vector;
+    int is_irq = v >= IRQ_BASE && v < IRQ_BASE + 16;
+    if (is_irq && irq_chip == &pic_chip) {
+        uint32_t irq = v - IRQ_BASE;
+        // IRQ 7/15 with the ISR bit clear are spurious: no handler, and no
+        // EOI to the PIC that raised it
+        if (irq == 7 && !(pic_isr(PIC_1_COMMAND) & 0x80)) {
+            spurious_irqs++;
+            return;
+        }
+        if (irq == 15 && !(pic_isr(PIC_2_COMMAND) & 0x80)) {
+            spurious_irqs++;
+            PIC_sendEOI(2);
+            return;
+        }
+    }
+    if (v == SPURIOUS_VECTOR) {
+        spurious_irqs++;
+        return;
+    }
 
-__attribute__((interrupt)) void coprocessor_error_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-    while(1);
+    if (is_irq || v >= LOCAL_VECTOR_BASE) {
+        if (handlers[v])
+            run_handler(tf, handlers[v]);
+        irq_chip->eoi(v);
+        // Bottom halves and preemption, if the interrupted code could
+        // have taken this interrupt with interrupts on anyway
+        if (tf->eflags & 0x200) {
+            if (tasklets_pending())
+                run_tasklets();
+            sched_irq_exit();
+        }
+        return;
+    }
+    if (handlers[v])
+        run_handler(tf, handlers[v]);
+    else
+        unhandled_interrupt(tf);
+}
+
+/* ===== Statistics ===== */
+
+const struct interrupt_stats *interrupt_stats(uint8_t vector) {
+    return &stats[vector];
+}
+
+void interrupt_stats_reset(void) {
+    uint32_t flags = irq_save();
+    memset((char*)stats, 0, sizeof(stats));
+    spurious_irqs = 0;
+    irq_restore(flags);
+}
+
+static const char *vector_name(uint32_t v) {
+    static const char *const irq_names[16] = {
+        "timer", "keyboard", "cascade", "com2", "com1", "lpt2", "floppy", "lpt1",
+        "rtc", "acpi", "irq10", "irq11", "mouse", "fpu", "ata0", "ata1",
+    };
+    if (v < 32)
+        return exception_names[v] ? exception_names[v] : "reserved";
+    if (v >= IRQ_BASE && v < IRQ_BASE + 16)
+        return irq_names[v - IRQ_BASE];
+    if (v == 0x80)
+        return "syscall";
+    if (v == LOCAL_VECTOR_BASE)
+        return "lapic timer";
+    return "";
+}
+
+// Cycles as microseconds, for printing (rprintf has no 64-bit conversions)
+static uint32_t cycles_us(uint64_t c) {
+    uint64_t us = div64_32(cycles_to_ns(c), 1000u, 0);
+    return us >> 31 ? 0x7FFFFFFFu : (uint32_t)us;
+}
+
+void interrupt_stats_dump(int (*pc)(int)) {
+    // Snapshot so the numbers of one line are consistent with each other
+    esp_printf(pc, "vec  %-20s %8s %10s %8s %8s\n", "source", "count", "total us", "avg cyc", "max cyc");
+    for (uint32_t v = 0; v < IDT_SIZE; v++) {
+        uint32_t flags = irq_save();
+        struct interrupt_stats st = stats[v];
+        irq_restore(flags);
+        if (!st.count)
+            continue;
+        esp_printf(pc, "%3d  %-20s %8d %10d %8d %8d\n", v, vector_name(v), st.count,
+                   cycles_us(st.cycles), (uint32_t)div64_32(st.cycles, st.count, 0), st.max_cycles);
+    }
+    if (spurious_irqs)
+        esp_printf(pc, "spurious: %d\n", spurious_irqs);
+    esp_printf(pc, "controller: %s\n", irq_chip->name);
 }
 
-__attribute__((interrupt)) void stub_isr(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-    while(1);
+static void dump_hist(int (*pc)(int), const char *what, const uint32_t *hist) {
+    esp_printf(pc, "%s (cycles):\n", what);
+    for (uint32_t b = 0; b < IRQ_HIST_BUCKETS; b++) {
+        if (!hist[b])
+            continue;
+        esp_printf(pc, "  >= 2^%d: %d\n", b, hist[b]);
+    }
 }
 
-__attribute__((interrupt)) void pit_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-    while(1);
+void interrupt_stats_dump_vector(int (*pc)(int), uint8_t vector) {
+    uint32_t flags = irq_save();
+    struct interrupt_stats st = stats[vector];
+    irq_restore(flags);
+    esp_printf(pc, "vector %d (%s): %d calls, %d us in handler\n",
+               vector, vector_name(vector), st.count, cycles_us(st.cycles));
+    dump_hist(pc, "handler time", st.duration_hist);
+    dump_hist(pc, "entry latency", st.latency_hist);
 }
 
+/* ===== Built-in handlers ===== */
 
-__attribute__((interrupt)) void keyboard_handler(struct interrupt_frame* frame)
+// Not-present faults inside a vm_reserve()d region are backed on demand and
+// writes to copy-on-write pages get a private copy; anything else is fatal
+static void page_fault_handler(struct trap_frame *tf)
 {
-    asm("cli");
-    /* do something */
-    outb(0x20,0x20);
-}
+    uint32_t addr;
+    uint32_t error_code = tf->err_code;
+    asm("mov %%cr2, %0" : "=r"(addr));   // faulting address
 
+    if (vm_handle_fault(addr, error_code) == 0)
+        return;
+    if (!(error_code & PF_PRESENT) && vmalloc_sync_fault(addr) == 0)
+        return;
+    if ((error_code & (PF_PRESENT | PF_WRITE)) == (PF_PRESENT | PF_WRITE) && cow_handle_fault(addr) == 0)
+        return;
 
-__attribute__((interrupt)) void syscall_handler(struct interrupt_frame* frame)
-{
     asm("cli");
-    /* do something */
+    esp_printf(putc, "Page fault at 0x%08x (error 0x%x, eip 0x%08x)\n", addr, error_code, tf->eip);
     while(1);
 }
 
@@ -421,30 +537,13 @@ void init_idt() {
 
     memset((char*)&idt_entries, 0, sizeof(struct idt_entry)*256);
 
+    extern char isr_stubs[];
     for(i = 0; i < 256; i++){
-        idt_set_gate( i, (uint32_t)stub_isr, 0x08, 0x8E);
+        idt_set_gate( i, (uint32_t)isr_stubs + i * ISR_STUB_SIZE, 0x08, 0x8E);
     }
-    idt_set_gate(0, (uint32_t)divide_error_handler, 0x08, 0x8e);
-    idt_set_gate(1, (uint32_t)debug_exception_handler, 0x08, 0x8e);
-    idt_set_gate(2, (uint32_t)breakpoint_exception_handler, 0x08, 0x8e);
-    idt_set_gate(3, (uint32_t)overflow_handler, 0x08, 0x8e);
-    idt_set_gate(4, (uint32_t)overflow_handler, 0x08, 0x8e);
-    idt_set_gate(5, (uint32_t)bound_check_handler, 0x08, 0x8e);
-    idt_set_gate(6, (uint32_t)invalid_opcode_handler, 0x08, 0x8e);
-    idt_set_gate(7, (uint32_t)coprocessor_not_available_handler, 0x08, 0x8e);
-    idt_set_gate(8, (uint32_t)double_fault_handler, 0x08, 0x8e);
-//    idt_set_gate(9, (uint32_t)coprocessor_segment_overrun_handler, 0x08, 0x8e);
-    idt_set_gate(10, (uint32_t)invalid_tss_handler, 0x08, 0x8e);
-    idt_set_gate(11, (uint32_t)segment_not_present_handler, 0x08, 0x8e);
-    idt_set_gate(12, (uint32_t)stack_exception_handler, 0x08, 0x8e);
-
-    idt_set_gate(13, (uint32_t)general_protection_handler, 0x08, 0x8e);
-    idt_set_gate(14, (uint32_t)page_fault_handler, 0x08, 0x8e);
-//    idt_set_gate(15, (uint32_t)coprocessor_error_handler, 0x08, 0x8e);
-
-    idt_set_gate(0x21, (uint32_t)keyboard_handler,0x08, 0x8e);
-    idt_set_gate(0x80, (uint32_t)syscall_handler,0x08, 0xee); // Set flags to EE, making DPL = 3 so it is accessible from userspace
-    idt_set_gate(32,   (uint32_t)pit_handler, 0x08, 0x8e);
+    idt_set_gate(0x80, (uint32_t)isr_stubs + 0x80 * ISR_STUB_SIZE, 0x08, 0xee); // Set flags to EE, making DPL = 3 so it is accessible from userspace
+
+    register_interrupt_handler(14, page_fault_handler);
     idt_flush(&idt_ptr);
 }
 
@@ -472,8 +571,7 @@ void remap_pic(void)
     /* mask interrupts */
     outb(0x21 , 0xff);
     outb(0xA1 , 0xff);
-    /* Initialization finished */
-    outb(0x21, 0xfd); // Enable keyboard interrupts
+    /* Initialization finished; register_irq_handler() unmasks lines as drivers claim them */
 }
 
 
@@ -148,6 +148,85 @@ struct gdt_entry_bits
 
 
 
+/* Register state saved by the common entry path in isr_stubs.S, lowest
+   address first. user_esp/user_ss are only there when entered from ring 3. */
+struct trap_frame {
+    uint64_t entry_tsc;                                      // 0 without a TSC
+    uint32_t gs, fs, es, ds;
+    uint32_t edi, esi, ebp, esp_pusha, ebx, edx, ecx, eax;   // pusha
+    uint32_t vector, err_code;                               // pushed by the stub (or CPU)
+    uint32_t eip, cs, eflags;                                // pushed by the CPU
+    uint32_t user_esp, user_ss;
+};
+
+#define ISR_STUB_SIZE 16        /* bytes between entry stubs in isr_stubs.S */
+#define IRQ_BASE      0x20      /* vector of ISA IRQ 0 (PIC or I/O APIC) */
+#define LOCAL_VECTOR_BASE 0xF0  /* 0xF0-0xFE: local APIC sources (timer, ...) */
+#define SPURIOUS_VECTOR   0xFF  /* local APIC spurious interrupt: no EOI */
+
+typedef void (*interrupt_handler_t)(struct trap_frame *tf);
+
+/* Install a handler for an IDT vector. Fails (-1) if one is already
+   installed; passing NULL removes it. Unhandled exceptions are fatal. */
+int register_interrupt_handler(uint8_t vector, interrupt_handler_t handler);
+
+/* Install a handler for ISA IRQ line irq (0-15) and unmask the line (or
+   mask it again when handler is NULL). The EOI is sent by the dispatcher
+   after the handler returns. */
+int register_irq_handler(uint8_t irq, interrupt_handler_t handler);
+
+/* The interrupt controller ISA IRQs are routed through: the 8259 pair by
+   default, or the I/O APIC + local APIC (apic.c). eoi() gets the vector so
+   local APIC sources (LOCAL_VECTOR_BASE and up) can be acknowledged too. */
+struct irq_chip {
+   const char *name;
+   void (*mask)(uint8_t irq);
+   void (*unmask)(uint8_t irq);
+   void (*eoi)(uint8_t vector);
+};
+
+extern struct irq_chip pic_chip;
+
+/* Switch to another controller: lines with a handler are masked on the old
+   chip and unmasked on the new one. */
+void irq_set_chip(struct irq_chip *chip);
+struct irq_chip *irq_get_chip(void);
+
+/* Per-vector statistics, kept by interrupt_dispatch(). Histogram bucket k
+   counts events of [2^k, 2^(k+1)) cycles (bucket 0 also holds 0). Latency
+   is from the entry stub to the handler, so it includes the register save
+   and dispatch overhead; handler time is the handler call itself. */
+#define IRQ_HIST_BUCKETS 32
+
+struct interrupt_stats {
+    uint32_t count;
+    uint64_t cycles;                              // total in the handler
+    uint32_t max_cycles;
+    uint32_t duration_hist[IRQ_HIST_BUCKETS];
+    uint32_t latency_hist[IRQ_HIST_BUCKETS];
+};
+
+const struct interrupt_stats *interrupt_stats(uint8_t vector);
+void interrupt_stats_reset(void);
+
+/* Print a summary line for every vector that fired, or both histograms of
+   one vector. */
+void interrupt_stats_dump(int (*pc)(int));
+void interrupt_stats_dump_vector(int (*pc)(int), uint8_t vector);
+
+/* Disable interrupts around a critical section, restoring the previous
+   IF state afterwards (so nesting and use from handlers are safe). */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl\n\tpop %0\n\tcli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & 0x200)   // EFLAGS.IF
+        __asm__ __volatile__("sti" ::: "memory");
+}
+
 void PIC_sendEOI(unsigned char irq);
 void IRQ_clear_mask(unsigned char IRQline);
 void IRQ_set_mask(unsigned char IRQline);
@@ -0,0 +1,73 @@
+#include "kbd.h"
+#include "clockevent.h"
+#include "interrupt.h"
+#include "sched.h"
+
+#define KBD_DATA_PORT 0x60
+
+uint8_t inb(uint16_t _port);
+
+static uint8_t ring[KBD_BUF_SIZE];
+static volatile uint32_t head = 0;   // next slot to fill; written by the IRQ only
+static volatile uint32_t tail = 0;   // next slot to read; written by the consumer only
+static volatile uint32_t dropped = 0;
+static struct tasklet *bottom_half = 0;
+static struct wait_queue readers;    // threads blocked in kbd_wait()
+
+// Keeps the compiler from moving ring accesses across head/tail updates
+// (one CPU, so no fence instruction is needed)
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+static void kbd_irq(struct trap_frame *tf) {
+    uint8_t code = inb(KBD_DATA_PORT);   // always read, or the controller stalls
+    uint32_t h = head;
+    if (h - tail == KBD_BUF_SIZE) {
+        dropped++;
+        return;
+    }
+    ring[h & (KBD_BUF_SIZE - 1)] = code;
+    barrier();
+    head = h + 1;
+    if (bottom_half)
+        tasklet_schedule(bottom_half);
+    wake_up(&readers);
+}
+
+unsigned int kbd_read(uint8_t *out, unsigned int max) {
+    uint32_t t = tail;
+    uint32_t avail = head - t;
+    barrier();
+    if (avail > max)
+        avail = max;
+    for (uint32_t i = 0; i < avail; ++i)
+        out[i] = ring[(t + i) & (KBD_BUF_SIZE - 1)];
+    barrier();
+    tail = t + avail;
+    return avail;
+}
+
+void kbd_init(struct tasklet *bh) {
+    bottom_half = bh;
+    register_irq_handler(1, kbd_irq);
+}
+
+int kbd_pending(void) {
+    return head != tail;
+}
+
+void kbd_wait(void) {
+    // Check with interrupts off so an IRQ can't slip in between the test
+    // and the sleep
+    __asm__ __volatile__("cli" ::: "memory");
+    while (!kbd_pending()) {
+        if (sched_can_block())
+            wait_on(&readers);
+        else
+            cpu_idle();
+    }
+    __asm__ __volatile__("sti" ::: "memory");
+}
+
+uint32_t kbd_dropped(void) {
+    return dropped;
+}
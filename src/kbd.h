@@ -0,0 +1,34 @@
+#ifndef KBD_H
+#define KBD_H
+
+#include <stdint.h>
+#include "tasklet.h"
+
+/* ===== PS/2 keyboard =====
+   IRQ1 reads the scancode from port 0x60 and pushes it into a
+   single-producer/single-consumer ring: the interrupt handler is the only
+   writer of head, the consumer the only writer of tail, so neither side
+   needs a lock. When the ring is full new scancodes are dropped (and
+   counted) rather than overwriting unread ones. */
+
+#define KBD_BUF_SIZE 256u   /* power of two */
+
+// Hooks IRQ1. Call after init_idt(). If bh is not NULL it is scheduled
+// after every scancode, to drain the ring outside the interrupt.
+void kbd_init(struct tasklet *bh);
+
+// Copies up to max pending scancodes to out, oldest first. Returns how many.
+unsigned int kbd_read(uint8_t *out, unsigned int max);
+
+// Nonzero if scancodes are waiting
+int kbd_pending(void);
+
+// Waits until at least one scancode is pending: blocks the calling thread,
+// or halts the CPU before the scheduler runs. Interrupts must be set up;
+// they are left enabled.
+void kbd_wait(void);
+
+// Scancodes lost because the ring was full
+uint32_t kbd_dropped(void);
+
+#endif // KBD_H
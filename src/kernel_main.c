@@ -2,14 +2,53 @@
 #include "rprintf.h"
 #include "page.h"
 #include "paging.h"
+#include "multiboot.h"
+#include "kmalloc.h"
+#include "interrupt.h"
+#include "vm.h"
+#include "vmalloc.h"
+#include "kbd.h"
+#include "timer.h"
+#include "clockevent.h"
+#include "tsc.h"
+#include "shell.h"
+#include "apic.h"
+#include "syscall.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "sched.h"
+#include "ide.h"
+#include "bcache.h"
+#include "fat.h"
 
 #define MULTIBOOT2_HEADER_MAGIC 0xe85250d6
 
+// Most usable RAM ranges we take from the bootloader's memory map
+#define MAX_MEM_REGIONS 16
+
 // Multiboot2 header for GRUB
 const unsigned int multiboot_header[] __attribute__((section(".multiboot"))) = {
     MULTIBOOT2_HEADER_MAGIC, 0, 16, -(16 + MULTIBOOT2_HEADER_MAGIC), 0, 12
 };
 
+/* GRUB jumps here with EAX = Multiboot2 magic and EBX = physical address of
+   the boot information. Switch onto our own 16 KiB stack (the .stack section,
+   so it's covered by the kernel image) and hand both values to main(). */
+__asm__(
+    ".pushsection .text\n"
+    ".global kernel_entry\n"
+    "kernel_entry:\n"
+    "    mov  $_end_stack, %esp\n"
+    "    push %ebx\n"
+    "    push %eax\n"
+    "    call main\n"
+    "1:  hlt\n"
+    "    jmp  1b\n"
+    ".popsection\n"
+    ".pushsection .stack, \"aw\", @nobits\n"
+    "    .space 16384\n"
+    ".popsection\n");
+
 uint8_t inb(uint16_t _port) {
     uint8_t rv;
     __asm__ __volatile__("inb %1, %0" : "=a"(rv) : "dN"(_port));
@@ -119,106 +158,628 @@ int putc(int ch) {
 
     int print_string(void (*pc)(char), char *s){
         while(*s != 0){
-            uint8_t status = inb(0x64);
             pc(*s);
             s++;
         }
+        return 0;
     }
 
 void test_page_allocator(void) {
     esp_printf(putc, "\n=== PAGE FRAME ALLOCATOR TEST ===\n");
 
-    // Initialize allocator
-    init_pfa_list();
-    esp_printf(putc, "Initial free pages: %u\n", pfa_free_count());
+    esp_printf(putc, "Initial free pages: %d\n", pfa_free_count());
 
-    // Allocate 4 pages
-    struct ppage *block = allocate_physical_pages(4);
+    // Allocate 5 pages: normally a 4-page block plus a 1-page block
+    struct ppage *block = allocate_physical_pages(5);
     if (!block) {
         esp_printf(putc, "Allocation failed!\n");
         return;
     }
 
-    esp_printf(putc, "Free pages after alloc(4): %u\n", pfa_free_count());
+    esp_printf(putc, "Free pages after alloc(5): %d\n", pfa_free_count());
 
-    // Display allocated pages and their addresses
+    // Display allocated blocks, their addresses and sizes
     struct ppage *cur = block;
     int i = 0;
     while (cur) {
-        esp_printf(putc, "Page %d addr: 0x%08x\n", i++, (uint32_t)cur->physical_addr);
+        esp_printf(putc, "Block %d addr: 0x%08x  pages: %d\n", i++,
+                   (uint32_t)cur->physical_addr, 1 << cur->order);
         cur = cur->next;
     }
 
-    // Free the pages back
+    // Allocate one physically contiguous order-3 (8 page) block
+    struct ppage *contig = allocate_contiguous(3);
+    if (contig)
+        esp_printf(putc, "Contiguous order-3 block at 0x%08x\n", (uint32_t)contig->physical_addr);
+
+    // Free everything back; the free count should return to its initial value
+    free_physical_pages(contig);
     free_physical_pages(block);
-    esp_printf(putc, "Free pages after free: %u\n", pfa_free_count());
+    esp_printf(putc, "Free pages after free: %d\n", pfa_free_count());
+
+    // Time the common paths: single frames and a mixed 5-page request
+    for (int n = 0; n < 1000; n++) {
+        void *frame;
+        {
+            TIME_SCOPE("pfa_alloc_frames(0)");
+            frame = pfa_alloc_frames(0);
+        }
+        {
+            TIME_SCOPE("pfa_free_frames(0)");
+            pfa_free_frames(frame, 0);
+        }
+        TIME_SCOPE("alloc+free 5 pages");
+        free_physical_pages(allocate_physical_pages(5));
+    }
+    timing_dump(putc);
 
     // Print final summary
     esp_printf(putc, "Allocator test complete.\n");
-    esp_printf(putc, "Total managed memory: %u MiB\n",
-                (unsigned int)((128 * (PFA_PAGE_BYTES >> 20)))); // 128 * 2 MiB = 256
+    esp_printf(putc, "Total managed memory: %d MiB\n",
+                pfa_total_count() >> (20 - PFA_PAGE_SHIFT)); // 256 frames per MiB
+}
+
+void test_kmalloc(void) {
+    esp_printf(putc, "\n=== KERNEL HEAP TEST ===\n");
+    unsigned int before = pfa_free_count();
+
+    // 100 small objects should share a handful of slab pages
+    void *objs[100];
+    for (int i = 0; i < 100; i++)
+        objs[i] = kmalloc(24);
+    esp_printf(putc, "100 x kmalloc(24): first=0x%08x last=0x%08x, %d pages used\n",
+               (uint32_t)objs[0], (uint32_t)objs[99], before - pfa_free_count());
+
+    // A cache for a fixed-size kernel object
+    struct kmem_cache *cache = kmem_cache_create("test-obj", 40, 8);
+    void *a = kmem_cache_alloc(cache);
+    void *b = kmem_cache_alloc(cache);
+    esp_printf(putc, "kmem_cache_alloc(40): 0x%08x 0x%08x\n", (uint32_t)a, (uint32_t)b);
+
+    // Too big for a size class: comes straight from the frame allocator
+    void *big = kmalloc(10000);
+    esp_printf(putc, "kmalloc(10000): 0x%08x\n", (uint32_t)big);
+
+    kfree(big);
+    kmem_cache_free(cache, a);
+    kmem_cache_free(cache, b);
+    kmem_cache_shrink(cache);
+    for (int i = 0; i < 100; i++)
+        kfree(objs[i]);
+    esp_printf(putc, "Pages still held after freeing: %d\n", before - pfa_free_count());
+}
+
+void test_demand_paging(void) {
+    esp_printf(putc, "\n=== DEMAND PAGING TEST ===\n");
+    unsigned int before = pfa_free_count();
+
+    // Reserving 64 MiB costs nothing until pages are touched
+    struct vm_region *r = vm_reserve(0x40000000u, 64u << 20, VM_WRITE);
+    if (!r) {
+        esp_printf(putc, "vm_reserve failed!\n");
+        return;
+    }
+    esp_printf(putc, "Reserved 64 MiB at 0x%08x, pages used: %d\n", r->start, before - pfa_free_count());
+
+    // Touch three pages far apart: each one faults in a zeroed frame
+    volatile uint32_t *p = (volatile uint32_t *)r->start;
+    uint32_t sum = p[0];
+    p[1] = 0x1234;
+    p[(32u << 20) / 4] = 0x5678;
+    sum += p[((64u << 20) - PAGE_SIZE) / 4];
+    esp_printf(putc, "Touched 3 pages: faults=%d resident=%d zero-sum=%d\n", r->faults, r->resident, sum);
+
+    vm_release(r);
+    esp_printf(putc, "Released, pages still held: %d\n", before - pfa_free_count());
+}
+
+void test_cow_clone(void) {
+    esp_printf(putc, "\n=== COPY-ON-WRITE CLONE TEST ===\n");
+    unsigned int start = pfa_free_count();
+
+    struct vm_region *r = vm_reserve(0x48000000u, 16 * PAGE_SIZE, VM_WRITE | VM_USER);
+    if (!r) {
+        esp_printf(putc, "vm_reserve failed!\n");
+        return;
+    }
+    volatile uint32_t *p = (volatile uint32_t *)r->start;
+    p[0] = 111;
+    p[PAGE_SIZE / 4] = 333;
+
+    unsigned int before = pfa_free_count();
+    struct page_directory_entry *child = clone_address_space(kernel_pd);
+    if (!child) {
+        esp_printf(putc, "clone_address_space failed!\n");
+        vm_release(r);
+        return;
+    }
+    esp_printf(putc, "Cloned: pages used=%d (page tables only)\n", before - pfa_free_count());
+
+    // Write in the child: faults, copies one page
+    loadPageDirectory(child);
+    uint32_t seen = p[0];
+    p[0] = 222;
+    loadPageDirectory(kernel_pd);
+    esp_printf(putc, "child saw %d then wrote 222; parent still sees %d, second page %d\n",
+               seen, p[0], p[PAGE_SIZE / 4]);
+
+    destroy_address_space(child);
+    vm_release(r);
+    esp_printf(putc, "Pages still held after teardown: %d\n", start - pfa_free_count());
 }
 
+void test_vmalloc(void) {
+    esp_printf(putc, "\n=== VMALLOC TEST ===\n");
+    unsigned int before = pfa_free_count();
+
+    // 1 MiB, virtually contiguous, from whatever frames are free
+    uint32_t *a = vmalloc(1u << 20);
+    uint32_t *b = vmalloc(3 * PAGE_SIZE);
+    if (!a || !b) {
+        esp_printf(putc, "vmalloc failed!\n");
+        return;
+    }
+    for (uint32_t i = 0; i < (1u << 20) / 4; i += PAGE_SIZE / 4)
+        a[i] = i;
+    esp_printf(putc, "vmalloc(1 MiB)=0x%08x vmalloc(12 KiB)=0x%08x, pages used: %d\n",
+               (uint32_t)a, (uint32_t)b, before - pfa_free_count());
+
+    // Freeing the first range lets a smaller request reuse its start
+    vfree(a);
+    uint32_t *c = vmalloc(PAGE_SIZE);
+    esp_printf(putc, "after vfree, vmalloc(4 KiB)=0x%08x\n", (uint32_t)c);
+
+    // Physical blocks from the frame allocator, mapped back to back
+    struct ppage *blocks = allocate_physical_pages(5);
+    uint8_t *m = vmap(blocks, PTE_RW);
+    m[0] = 1;
+    m[5 * PAGE_SIZE - 1] = 2;
+    esp_printf(putc, "vmap(5 pages)=0x%08x\n", (uint32_t)m);
+
+    vunmap(m);
+    free_physical_pages(blocks);
+    vfree(b);
+    vfree(c);
+    esp_printf(putc, "Pages still held after freeing: %d (page tables)\n", before - pfa_free_count());
+}
+
+static void note_fired(void *arg) {
+    esp_printf(putc, "  timer %d fired at jiffies=%d\n", (uint32_t)arg, jiffies);
+}
+
+void test_timer(void) {
+    esp_printf(putc, "\n=== TIMER TEST (HZ=%d) ===\n", HZ);
+
+    uint32_t start = jiffies;
+    msleep(100);
+    esp_printf(putc, "msleep(100): %d ticks elapsed\n", jiffies - start);
+
+    // Armed out of order, fire in expiry order; a cancelled one never fires.
+    // 300 ticks is past the first wheel level, so that one cascades.
+    struct timer t[4];
+    uint32_t now = jiffies;
+    for (int i = 0; i < 4; i++)
+        timer_setup(&t[i], note_fired, (void *)i);
+    timer_add(&t[0], now + 30);
+    timer_add(&t[1], now + 10);
+    timer_add(&t[2], now + 300);
+    timer_add(&t[3], now + 20);
+    timer_cancel(&t[3]);
+    esp_printf(putc, "armed at jiffies=%d\n", now);
+    uint32_t idle = idle_entries, nohz = nohz_entries;
+    msleep(jiffies_to_msecs(310));
+    esp_printf(putc, "310 ticks slept in %d hlt wakeups (%d tickless)\n",
+               idle_entries - idle, nohz_entries - nohz);
+}
+
+// Keyboard bottom half: drain everything queued into the command line
+static void kbd_bottom_half(void *unused) {
+    uint8_t codes[16];
+    unsigned int n;
+    while ((n = kbd_read(codes, sizeof(codes))) > 0) {
+        for (unsigned int i = 0; i < n; i++) {
+            // Only process valid scancodes (< 128 = key press)
+            if (codes[i] < 128 && keyboard_map[codes[i]])
+                shell_key(keyboard_map[codes[i]]);
+        }
+    }
+}
+
+static struct tasklet kbd_tasklet = { .fn = kbd_bottom_half };
+
 extern uint32_t _end_kernel; 
 
 /* ====== Tiny paging helpers (kept local to this file to stay contained) ====== */
-static inline uint32_t align_down_page(uint32_t x) { return x & ~0xFFFu; }
+static inline uint32_t align_up_large(uint32_t x) {
+    return (x + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+}
 
-/* identity-map [start, end) using the assignment's temp-ppage trick
-   NOTE: works with the simplified paging (single PT for 0..4MiB). */
-static void identity_map_range(uint32_t start, uint32_t end) {
-    const uint32_t LIM = 0x00400000u; // first 4MiB only
-    if (start >= LIM) return;
-    if (end   >  LIM) end = LIM;
+/* identity-map [start, end); whole 4 MiB chunks use PSE pages when available */
+static int identity_map_range(uint32_t start, uint32_t end) {
+    return map_physical_range(kernel_pd, start, start, end - start);
+}
 
-    start = align_down_page(start);
-    end   = align_down_page(end + PAGE_SIZE - 1);
+void test_fpu(void) {
+    esp_printf(putc, "\n=== LAZY FPU TEST ===\n");
+    if (!cpu_has(CPU_FEATURE_FPU)) {
+        esp_printf(putc, "No FPU\n");
+        return;
+    }
+    struct fpu_ctx a = { 0 }, b = { 0 }, idle = { 0 };
+    int32_t va, vb;
+    uint32_t flags = irq_save();
+
+    fpu_switch(&a);
+    __asm__ __volatile__("fld1\n\tfld1\n\tfaddp");   // a: st0 = 2
+    fpu_switch(&b);
+    __asm__ __volatile__("fld1");                    // b: st0 = 1, fresh registers
+    fpu_switch(&a);
+    __asm__ __volatile__("fistpl %0" : "=m"(va));
+    fpu_switch(&b);
+    __asm__ __volatile__("fistpl %0" : "=m"(vb));
+    uint32_t traps = fpu_traps;
+    fpu_switch(&idle);                               // never touches the FPU
+    fpu_switch(&b);                                  // still owns it: no trap
+    __asm__ __volatile__("fld1\n\tfstp %%st(0)" ::: "memory");
+
+    esp_printf(putc, "a=%d (expect 2) b=%d (expect 1), traps=%d saves=%d restores=%d, extra traps after idle switch: %d\n",
+               va, vb, fpu_traps, fpu_saves, fpu_restores, fpu_traps - traps);
+    fpu_release(&a);
+    fpu_release(&b);
+    fpu_switch(&fpu_boot_ctx);
+    irq_restore(flags);
+}
 
-    for (uint32_t a = start; a < end; a += PAGE_SIZE) {
-        struct ppage tmp; tmp.next = NULL; tmp.physical_addr = a; // VA==PA
-        (void)map_pages((void*)a, &tmp, kernel_pd);
+void test_syscalls(void) {
+    esp_printf(putc, "\n=== SYSCALL TEST ===\n");
+    const uint32_t iters = 10000;
+    uint64_t int80, fast;
+    if (syscall_bench(iters, &int80, &fast) < 0) {
+        esp_printf(putc, "syscall_bench failed!\n");
+        return;
     }
+    // Round trips from ring 3 include the loop overhead (a few cycles)
+    esp_printf(putc, "null syscall, int 0x80: %d cycles\n", (uint32_t)div64_32(int80, iters, 0));
+    if (syscall_fast_path())
+        esp_printf(putc, "null syscall, sysenter: %d cycles\n", (uint32_t)div64_32(fast, iters, 0));
+    else
+        esp_printf(putc, "no SYSENTER on this CPU\n");
 }
 
-// Kernel entry point
-void main() {
+struct spin_arg {
+    uint32_t until;              // jiffies
+    volatile uint32_t count;
+};
+
+// Never blocks or yields: only the timer tick can take the CPU away
+static void spin_thread(void *arg) {
+    struct spin_arg *a = arg;
+    while (time_before(jiffies, a->until))
+        a->count++;
+}
+
+static void sleeper_thread(void *arg) {
+    uint32_t *wakeups = arg;
+    for (int i = 0; i < 5; i++) {
+        thread_sleep(msecs_to_jiffies(20));
+        (*wakeups)++;
+    }
+}
+
+void test_threads(void) {
+    esp_printf(putc, "\n=== KERNEL THREAD TEST ===\n");
+    uint32_t switches = context_switches;
+    struct spin_arg a = { jiffies + msecs_to_jiffies(200), 0 };
+    struct spin_arg b = { a.until, 0 };
+    uint32_t wakeups = 0;
+
+    // Two equal-priority spinners share the CPU by time slice; the sleeper
+    // has a higher priority and preempts them whenever its timer fires
+    struct thread *ta = thread_create("spin-a", spin_thread, &a, PRIO_DEFAULT + 1);
+    struct thread *tb = thread_create("spin-b", spin_thread, &b, PRIO_DEFAULT + 1);
+    struct thread *ts = thread_create("sleeper", sleeper_thread, &wakeups, PRIO_DEFAULT - 1);
+    if (!ta || !tb || !ts) {
+        esp_printf(putc, "thread_create failed!\n");
+        return;
+    }
+    sched_dump(putc);
+    thread_join(ta);
+    thread_join(tb);
+    thread_join(ts);
+    esp_printf(putc, "spin-a %d, spin-b %d iterations, sleeper woke %d times (expect 5), %d switches\n",
+               a.count, b.count, wakeups, context_switches - switches);
+}
+
+// Sequential read of nsect sectors in one call (the driver splits it);
+// prints the time and how many commands and IRQs it took
+static void time_disk_read(const char *how, unsigned char *buf, uint32_t nsect) {
+    uint32_t cmds = ata_commands, irqs = ata_irqs;
+    uint64_t start = cycles();
+    int ret = ata_read(0, buf, nsect);
+    uint32_t us = (uint32_t)div64_32(cycles_to_ns(cycles() - start), 1000u, 0);
+    esp_printf(putc, "%s: %d KiB in %d us (%d), %d commands, %d IRQs\n", how,
+               nsect / 2, us, ret, ata_commands - cmds, ata_irqs - irqs);
+}
+
+void test_ata(void) {
+    esp_printf(putc, "\n=== ATA TEST ===\n");
+    if (ide_init() < 0) {
+        esp_printf(putc, "No ATA drive on the primary channel\n");
+        return;
+    }
+    const struct ata_info *id = ata_info();
+    esp_printf(putc, "%s: %d MiB, LBA48 %s, %d sectors per PIO block\n", id->model,
+               (uint32_t)(id->sectors >> 11), id->lba48 ? "yes" : "no", id->multiple);
+
+    const uint32_t nsect = 2048;   // 1 MiB
+    unsigned char *buf = kmalloc(nsect * ATA_SECTOR_SIZE);
+    if (!buf) {
+        esp_printf(putc, "kmalloc failed!\n");
+        return;
+    }
+    int dma = ide_set_dma(1);
+    int ret = ata_lba_read(0, buf, 1);
+    esp_printf(putc, "MBR read (%s): %d, signature 0x%02x%02x (expect 0x55aa)\n",
+               dma ? "DMA" : "PIO", ret, buf[510], buf[511]);
+
+    ide_set_dma(0);
+    time_disk_read("PIO", buf, nsect);
+    if (ide_set_dma(1))
+        time_disk_read("DMA", buf, nsect);
+
+    // A lower-priority spinner only gets the CPU while this thread sleeps
+    // on the disk
+    struct spin_arg spin = { jiffies + msecs_to_jiffies(5000), 0 };
+    struct thread *t = thread_create("spin", spin_thread, &spin, PRIO_DEFAULT + 1);
+    uint32_t irqs = ata_irqs;
+    uint64_t start = cycles();
+    ret = ata_lba_read(0, buf, nsect);
+    uint64_t spent = cycles() - start;
+    uint32_t spun = spin.count;
+    spin.until = jiffies;
+    if (t)
+        thread_join(t);
+    esp_printf(putc, "%d sectors: %d, %d us, %d IRQs, spinner ran %d iterations meanwhile\n",
+               nsect, ret, (uint32_t)div64_32(cycles_to_ns(spent), 1000u, 0), ata_irqs - irqs, spun);
+    kfree(buf);
+}
+
+#ifdef CONFIG_DISK_WRITE_TEST
+// Scratch sectors for the write tests: the end of the gap between GRUB's
+// core image and the first partition (LBA 2048). Restored afterwards, but
+// the test writes to the boot disk, so it is only built with
+// -DCONFIG_DISK_WRITE_TEST in the Makefile's CONFIGS.
+#define SCRATCH_LBA   1984u
+#define SCRATCH_SECTS 64u
+
+static void fill_pattern(unsigned char *buf, uint32_t nsect, uint8_t seed) {
+    for (uint32_t i = 0; i < nsect * ATA_SECTOR_SIZE; i++)
+        buf[i] = (uint8_t)(seed + i / ATA_SECTOR_SIZE + i * 7);
+}
+
+static int check_pattern(const unsigned char *buf, uint32_t nsect, uint8_t seed) {
+    for (uint32_t i = 0; i < nsect * ATA_SECTOR_SIZE; i++)
+        if (buf[i] != (uint8_t)(seed + i / ATA_SECTOR_SIZE + i * 7))
+            return 0;
+    return 1;
+}
+
+void test_writeback(void) {
+    esp_printf(putc, "\n=== WRITE-BACK TEST ===\n");
+    if (bcache_init() < 0) {
+        esp_printf(putc, "No drive, or bcache_init failed\n");
+        return;
+    }
+    unsigned char *saved = kmalloc(SCRATCH_SECTS * ATA_SECTOR_SIZE);
+    unsigned char *buf = kmalloc(SCRATCH_SECTS * ATA_SECTOR_SIZE);
+    if (!saved || !buf || ata_read(SCRATCH_LBA, saved, SCRATCH_SECTS) < 0) {
+        esp_printf(putc, "Couldn't save the scratch sectors\n");
+        kfree(saved);
+        kfree(buf);
+        return;
+    }
+
+    // Baseline: every small write is a synchronous PIO command
+    const uint32_t n = 16;
+    int dma = ide_set_dma(0);
+    fill_pattern(buf, n, 1);
+    uint64_t start = cycles();
+    int ret = 0;
+    for (uint32_t i = 0; i < n && ret == 0; i++)
+        ret = ata_write(SCRATCH_LBA + i, buf + i * ATA_SECTOR_SIZE, 1);
+    uint32_t us = (uint32_t)div64_32(cycles_to_ns(cycles() - start), 1000u, 0);
+    ide_set_dma(dma);
+    if (ret == 0)
+        ret = ata_read(SCRATCH_LBA, buf, n);
+    esp_printf(putc, "%d PIO writes: %d us each (%d), read back %s\n", n, us / n, ret,
+               ret == 0 && check_pattern(buf, n, 1) ? "OK" : "BAD");
+
+    // The same sectors, in reverse, through the write-back cache. Reads see
+    // them before they reach the disk.
+    fill_pattern(buf, SCRATCH_SECTS, 2);
+    uint32_t cmds = bcache_commands;
+    start = cycles();
+    ret = 0;
+    for (uint32_t i = SCRATCH_SECTS; i-- > 0 && ret == 0; )
+        ret = bcache_write(BDEV_ATA, SCRATCH_LBA + i, buf + i * ATA_SECTOR_SIZE, 1);
+    us = (uint32_t)div64_32(cycles_to_ns(cycles() - start), 1000u, 0);
+    esp_printf(putc, "%d cached writes: %d us total (%d), %d dirty\n", SCRATCH_SECTS, us, ret,
+               bcache_dirty_count());
+    ret = bcache_read(BDEV_ATA, SCRATCH_LBA, buf, SCRATCH_SECTS);
+    esp_printf(putc, "Read through the cache: %s\n",
+               ret == 0 && check_pattern(buf, SCRATCH_SECTS, 2) ? "OK" : "BAD");
+
+    uint32_t flushes = ata_flushes;
+    ret = bcache_sync();
+    esp_printf(putc, "sync: %d, %d write commands, %d FLUSH CACHE, %d dirty left\n", ret,
+               bcache_commands - cmds, ata_flushes - flushes, bcache_dirty_count());
+    ret = ata_read(SCRATCH_LBA, buf, SCRATCH_SECTS);
+    esp_printf(putc, "On disk: %s\n", ret == 0 && check_pattern(buf, SCRATCH_SECTS, 2) ? "OK" : "BAD");
+
+    // Aging: the flusher writes this one out by itself
+    fill_pattern(buf, 1, 3);
+    bcache_write(BDEV_ATA, SCRATCH_LBA, buf, 1);
+    thread_sleep(msecs_to_jiffies(BCACHE_AGE_MS + 2 * BCACHE_INTERVAL_MS));
+    esp_printf(putc, "After %d ms: %d dirty (expect 0)\n", BCACHE_AGE_MS + 2 * BCACHE_INTERVAL_MS,
+               bcache_dirty_count());
+
+    // Through the cache, which still holds the test data
+    ret = bcache_write(BDEV_ATA, SCRATCH_LBA, saved, SCRATCH_SECTS);
+    int synced = bcache_sync();
+    if (ret != 0 || synced != 0)
+        esp_printf(putc, "Restoring LBA %d-%d FAILED (write %d, sync %d)\n", SCRATCH_LBA,
+                   SCRATCH_LBA + SCRATCH_SECTS - 1, ret, synced);
+    else
+        esp_printf(putc, "Scratch sectors restored\n");
+    kfree(saved);
+    kfree(buf);
+}
+#endif
+
+// The FAT metadata pattern: the partition's boot sector, then the root
+// directory walked a few times, with a FAT lookup per directory sector.
+// Only the first pass should reach the disk.
+void test_bcache(void) {
+    esp_printf(putc, "\n=== BUFFER CACHE TEST ===\n");
+    struct buf *mbr = bread(BDEV_ATA, 0);
+    if (!mbr) {
+        esp_printf(putc, "No drive, or the MBR read failed\n");
+        return;
+    }
+    uint32_t part = *(uint32_t *)(mbr->data + 446 + 8);   // first partition's start LBA
+    struct buf *again = bread(BDEV_ATA, 0);
+    esp_printf(putc, "MBR twice: same buffer %s, refcnt %d\n", again == mbr ? "yes" : "no",
+               mbr->refcnt);
+    if (again)
+        brelse(again);
+    brelse(mbr);
+
+    struct buf *b = part ? bread(BDEV_ATA, part) : 0;
+    if (!b) {
+        esp_printf(putc, "No FAT partition\n");
+        return;
+    }
+    struct boot_sector *bs = (struct boot_sector *)b->data;
+    uint32_t fat = part + bs->num_reserved_sectors;
+    uint32_t root = fat + bs->num_fat_tables * bs->num_sectors_per_fat;
+    uint32_t root_sects = bs->num_root_dir_entries * sizeof(struct root_directory_entry) / BLOCK_SIZE;
+    brelse(b);
+    esp_printf(putc, "FAT partition at %d: FAT at %d, root directory at %d (%d sectors)\n",
+               part, fat, root, root_sects);
+
+    for (int pass = 0; pass < 4; pass++) {
+        uint32_t cmds = ata_commands, used = 0;
+        uint64_t start = cycles();
+        for (uint32_t i = 0; i < root_sects; i++) {
+            struct buf *fb = bread(BDEV_ATA, fat);
+            if (fb)
+                brelse(fb);
+            struct buf *db = bread(BDEV_ATA, root + i);
+            if (!db)
+                break;
+            struct root_directory_entry *e = (struct root_directory_entry *)db->data;
+            for (uint32_t k = 0; k < BLOCK_SIZE / sizeof(*e); k++)
+                if (e[k].file_name[0] && (uint8_t)e[k].file_name[0] != 0xE5)
+                    used++;
+            brelse(db);
+        }
+        uint32_t us = (uint32_t)div64_32(cycles_to_ns(cycles() - start), 1000u, 0);
+        esp_printf(putc, "Pass %d: %d entries in use, %d disk commands, %d us\n", pass, used,
+                   ata_commands - cmds, us);
+    }
+    bcache_dump(putc);
+}
+
+// Kernel entry point (called from kernel_entry)
+void main(uint32_t mb_magic, uint32_t mb_info) {
     esp_printf(putc, "Hello, World!\n");
     esp_printf(putc, "Execution level: %d\n", 0);
 
-        /* ---- page bring-up ---- */
-    // 1) Identity-map kernel [0x0010_0000, &_end_kernel)
-    identity_map_range(0x00100000u, (uint32_t)&_end_kernel);
+    if (mb_magic != MULTIBOOT2_BOOTLOADER_MAGIC) {
+        esp_printf(putc, "Not loaded by a Multiboot2 bootloader (magic 0x%08x)\n", mb_magic);
+        return;
+    }
 
-    // 2) Identity-map a small window around the current stack (8 pages)
-    uint32_t esp_val; __asm__ __volatile__("mov %%esp,%0" : "=r"(esp_val));
-    uint32_t stack_lo  = align_down_page(esp_val) - 7*PAGE_SIZE;
-    uint32_t stack_hi  = align_down_page(esp_val) + 1*PAGE_SIZE;
-    identity_map_range(stack_lo, stack_hi);
+        /* ---- physical memory bring-up ---- */
+    // Free frames come from the usable RAM in GRUB's memory map, minus low
+    // memory (IVT, BIOS data, VGA, ROMs), the kernel image and the boot info
+    struct mem_region usable[MAX_MEM_REGIONS];
+    unsigned int nusable = multiboot_memory_map(mb_info, usable, MAX_MEM_REGIONS);
+    struct mem_region reserved[] = {
+        { 0,           0x00100000u },
+        { 0x00100000u, (uint32_t)&_end_kernel },
+        { mb_info,     mb_info + multiboot_info_size(mb_info) },
+    };
+    init_pfa(usable, nusable, reserved, sizeof(reserved) / sizeof(reserved[0]));
+    kmalloc_init();
+    vmalloc_init();
+    tsc_init();
+    if (tsc_khz)
+        esp_printf(putc, "TSC: %d kHz\n", tsc_khz);
 
-    // 3) Identity-map VGA text buffer @ 0xB8000 (one page is enough)
-    identity_map_range(0x000B8000u, 0x000B8000u + PAGE_SIZE);
+        /* ---- page bring-up ---- */
+    uint64_t paging_start = cycles();
+    int pse = paging_enable_pse();
+
+    // 1) Identity-map low memory (incl. VGA @ 0xB8000), the kernel with its
+    //    stack, and all RAM the frame allocator manages, so the frames it
+    //    hands out can be used at their physical address. Page 0 stays
+    //    unmapped so NULL dereferences fault; past the first 4 MiB (one
+    //    page table) PSE makes the rest 4 MiB pages.
+    uint32_t ram_top = align_up_large(pfa_total_count() << PFA_PAGE_SHIFT);
+    if (ram_top < align_up_large((uint32_t)&_end_kernel))
+        ram_top = align_up_large((uint32_t)&_end_kernel);
+    if (identity_map_range(PAGE_SIZE, ram_top) < 0) {
+        esp_printf(putc, "Out of memory for page tables mapping 0x%08x bytes\n", ram_top);
+        return;
+    }
 
-    // 4) Load CR3 and enable paging (CR0.PE | CR0.PG)
+    // 2) PDE 1023 maps the directory itself, for get_physaddr() and
+    //    friends; then load CR3 and enable paging (CR0.PE | CR0.PG)
+    paging_init_recursive(kernel_pd);
     loadPageDirectory(kernel_pd);
     enablePaging();
-    esp_printf(putc, "Paging enabled. PD=%p  kernel=%p..%p  stack~%p  VGA=0xB8000\n",
-               kernel_pd, (void*)0x00100000u, &_end_kernel, (void*)esp_val);
+    uint32_t paging_us = (uint32_t)div64_32(cycles_to_ns(cycles() - paging_start), 1000u, 0);
+    esp_printf(putc, "Paging enabled in %d us. PD=0x%08x  kernel=0x%08x..0x%08x  RAM top=0x%08x  %s pages\n",
+               paging_us, (uint32_t)kernel_pd, 0x00100000u, (uint32_t)&_end_kernel, ram_top,
+               pse ? "4 MiB" : "4 KiB");
     /* ---- end paging bring-up ---- */
+
+    remap_pic();  // Set up the PC's programmable interrupt controller (PIC)
+    load_gdt();   // Load the global descriptor table
+    init_idt();   // Exceptions (page faults for demand paging) work from here on
+    syscall_init(); // int 0x80, plus SYSENTER if the CPU has it
+    fpu_init();     // CR0/CR4 FPU bits and the #NM hook for lazy switching
     
     test_page_allocator();
-
-    while (1){
-         // Read keyboard controller status port (0x64)
-        uint8_t status = inb(0x64);
-
-        // If output buffer is full (bit 0 = 1), read scancode
-        if (status & 1) {
-            uint8_t scancode = inb(0x60);   // Get scancode from port 0x60
-
-            // Only process valid scancodes (< 128 = key press)
-            if (scancode < 128) {
-                esp_printf(putc, "0x%02x %c\n", scancode, keyboard_map[scancode]);
-            } //Ignore key releases for now
-        } // Prevent CPU from running into invalid instructions
-    }
+    test_kmalloc();
+    test_demand_paging();
+    test_cow_clone();
+    test_vmalloc();
+    test_fpu();
+    sched_init(); // main() becomes a thread; the idle thread runs cpu_idle()
+
+    // I/O APIC + local APIC when the MADT describes them, else the 8259
+    if (apic_init(multiboot_acpi_rsdp(mb_info)) == 0)
+        esp_printf(putc, "Interrupts routed through the I/O APIC\n");
+    pit_clockevent_init(); // IRQ0 at HZ, tickless when idle
+    kbd_init(&kbd_tasklet); // IRQ1; decoding runs in kbd_bottom_half()
+    if (apic_timer_init() == 0)
+        esp_printf(putc, "Tick device: local APIC timer, %d counts per tick\n",
+                   clockevent_current()->counts_per_tick);
+    asm("sti");   // IRQ0 ticks and IRQ1 feeds the keyboard ring from here on
+    test_timer();
+    test_syscalls();
+    test_threads();
+    test_ata();
+    bcache_init();   // no drive: bread() and friends just fail
+#ifdef CONFIG_DISK_WRITE_TEST
+    test_writeback();
+#endif
+    test_bcache();
+
+    // Everything from here on happens in tasklets; the idle thread runs
+    // them and otherwise sleeps in hlt
+    shell_prompt();
+    thread_exit();
 }
@@ -0,0 +1,270 @@
+#include "kmalloc.h"
+#include "page.h"
+#include "interrupt.h"
+
+#define SLAB_BYTES   PFA_PAGE_BYTES
+#define SLAB_MAGIC   0x51AB51ABu
+#define LARGE_MAGIC  0x1A26EB1Cu
+
+// Completely free slabs kept around per cache before giving frames back
+#define SLAB_KEEP_EMPTY 1u
+
+#define KMALLOC_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1u)
+
+/* Slab header, at the start of the slab's frame. kfree() finds it by
+   rounding an object pointer down to the frame. */
+struct slab {
+    uint32_t magic;
+    struct kmem_cache *cache;   // owner
+    struct slab *next;          // on the owner's partial/full/empty list
+    struct slab *prev;
+    void *freelist;             // free objects, linked through their first word
+    uint32_t inuse;             // objects handed out
+};
+
+/* Header in front of allocations too big for a size class. Kept 16 bytes
+   so the returned pointer stays 16-byte aligned. */
+struct large_hdr {
+    uint32_t magic;
+    uint32_t order;
+    uint32_t pad[2];
+};
+
+struct kmem_cache {
+    const char *name;
+    uint32_t objsize;           // object size rounded up to the alignment
+    uint32_t offset;            // first object's offset within a slab
+    uint32_t per_slab;          // objects per slab
+    struct slab *partial;       // slabs with some free objects (alloc from here)
+    struct slab *full;          // slabs with no free objects
+    struct slab *empty;         // slabs with no objects in use
+    uint32_t nr_empty;
+    uint32_t nr_slabs;
+};
+
+// Bootstrap cache that kmem_cache_create() takes its descriptors from
+static struct kmem_cache cache_cache;
+static struct kmem_cache kmalloc_caches[KMALLOC_CLASSES];
+
+static const char *const kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-8", "kmalloc-16", "kmalloc-32", "kmalloc-64",
+    "kmalloc-128", "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+/* ---------- Internal helpers ---------- */
+
+static inline uint32_t align_up(uint32_t x, uint32_t a) { return (x + a - 1u) & ~(a - 1u); }
+
+static void bzero_bytes(void *dst, uint32_t bytes) {
+    uint8_t *p = (uint8_t *)dst;
+    while (bytes--) *p++ = 0;
+}
+
+static void slab_push(struct slab **head, struct slab *s) {
+    s->prev = NULL;
+    s->next = *head;
+    if (*head)
+        (*head)->prev = s;
+    *head = s;
+}
+
+static void slab_remove(struct slab **head, struct slab *s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *head = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+static void cache_setup(struct kmem_cache *cache, const char *name, size_t size, size_t align) {
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+
+    cache->name     = name;
+    cache->objsize  = align_up(size, align);
+    cache->offset   = align_up(sizeof(struct slab), align);
+    cache->per_slab = cache->offset < SLAB_BYTES ? (SLAB_BYTES - cache->offset) / cache->objsize : 0;
+    cache->partial  = cache->full = cache->empty = NULL;
+    cache->nr_empty = cache->nr_slabs = 0;
+}
+
+/* Carve a fresh frame into a slab and thread its objects on the freelist. */
+static struct slab *slab_grow(struct kmem_cache *cache) {
+    struct slab *s = (struct slab *)pfa_alloc_frames(0);
+    if (!s)
+        return NULL;
+
+    s->magic = SLAB_MAGIC;
+    s->cache = cache;
+    s->inuse = 0;
+    s->freelist = NULL;
+
+    uint8_t *obj = (uint8_t *)s + cache->offset + (cache->per_slab - 1) * cache->objsize;
+    for (uint32_t i = 0; i < cache->per_slab; ++i, obj -= cache->objsize) {
+        *(void **)obj = s->freelist;
+        s->freelist = obj;
+    }
+
+    cache->nr_slabs++;
+    return s;
+}
+
+static void slab_release(struct kmem_cache *cache, struct slab *s) {
+    s->magic = 0;
+    cache->nr_slabs--;
+    pfa_free_frames(s, 0);
+}
+
+static inline struct slab *slab_of(void *obj) {
+    return (struct slab *)((uintptr_t)obj & ~(uintptr_t)(SLAB_BYTES - 1));
+}
+
+/* ---------- Public API ---------- */
+
+void kmalloc_init(void) {
+    cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0);
+    for (unsigned int i = 0; i < KMALLOC_CLASSES; ++i) {
+        uint32_t size = 1u << (i + KMALLOC_MIN_SHIFT);
+        cache_setup(&kmalloc_caches[i], kmalloc_names[i], size, size < 16 ? size : 16);
+    }
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align) {
+    if (align & (align - 1))
+        return NULL;
+    struct kmem_cache *cache = kmem_cache_alloc(&cache_cache);
+    if (!cache)
+        return NULL;
+    cache_setup(cache, name, size, align);
+    if (cache->per_slab == 0) {
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+static void *cache_alloc(struct kmem_cache *cache) {
+    struct slab *s = cache->partial;
+    if (!s) {
+        if (cache->empty) {
+            s = cache->empty;
+            slab_remove(&cache->empty, s);
+            cache->nr_empty--;
+        } else if (!(s = slab_grow(cache))) {
+            return NULL;
+        }
+        slab_push(&cache->partial, s);
+    }
+
+    void *obj = s->freelist;
+    s->freelist = *(void **)obj;
+    s->inuse++;
+
+    if (!s->freelist) {
+        slab_remove(&cache->partial, s);
+        slab_push(&cache->full, s);
+    }
+    return obj;
+}
+
+static void cache_free(struct kmem_cache *cache, void *obj) {
+    struct slab *s = slab_of(obj);
+    if (!obj || s->magic != SLAB_MAGIC || s->cache != cache)
+        return;
+
+    int was_full = (s->freelist == NULL);
+    *(void **)obj = s->freelist;
+    s->freelist = obj;
+    s->inuse--;
+
+    if (was_full) {
+        slab_remove(&cache->full, s);
+        slab_push(&cache->partial, s);
+    }
+    if (s->inuse == 0) {
+        slab_remove(&cache->partial, s);
+        if (cache->nr_empty < SLAB_KEEP_EMPTY) {
+            slab_push(&cache->empty, s);
+            cache->nr_empty++;
+        } else {
+            slab_release(cache, s);
+        }
+    }
+}
+
+// The caches are shared with interrupt handlers and preemptible threads
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    uint32_t flags = irq_save();
+    void *obj = cache_alloc(cache);
+    irq_restore(flags);
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+    uint32_t flags = irq_save();
+    cache_free(cache, obj);
+    irq_restore(flags);
+}
+
+void kmem_cache_shrink(struct kmem_cache *cache) {
+    uint32_t flags = irq_save();
+    while (cache->empty) {
+        struct slab *s = cache->empty;
+        slab_remove(&cache->empty, s);
+        slab_release(cache, s);
+    }
+    cache->nr_empty = 0;
+    irq_restore(flags);
+}
+
+void *kmalloc(size_t size) {
+    if (size == 0)
+        return NULL;
+
+    if (size <= KMALLOC_MAX_SIZE) {
+        unsigned int shift = KMALLOC_MIN_SHIFT;
+        while ((1u << shift) < size)
+            shift++;
+        return kmem_cache_alloc(&kmalloc_caches[shift - KMALLOC_MIN_SHIFT]);
+    }
+
+    // Too big for a size class: take a whole buddy block, if one is big enough
+    if (size > (SLAB_BYTES << PFA_MAX_ORDER) - sizeof(struct large_hdr))
+        return NULL;
+    unsigned int order = 0;
+    while ((SLAB_BYTES << order) < size + sizeof(struct large_hdr))
+        order++;
+    struct large_hdr *hdr = pfa_alloc_frames(order);
+    if (!hdr)
+        return NULL;
+    hdr->magic = LARGE_MAGIC;
+    hdr->order = order;
+    return hdr + 1;
+}
+
+void *kzalloc(size_t size) {
+    void *p = kmalloc(size);
+    if (p)
+        bzero_bytes(p, size);
+    return p;
+}
+
+void kfree(void *ptr) {
+    if (!ptr)
+        return;
+
+    // Slab objects and large blocks both keep their header at the frame start
+    uint32_t *hdr = (uint32_t *)slab_of(ptr);
+    if (*hdr == SLAB_MAGIC) {
+        struct slab *s = (struct slab *)hdr;
+        kmem_cache_free(s->cache, ptr);
+    } else if (*hdr == LARGE_MAGIC) {
+        struct large_hdr *large = (struct large_hdr *)hdr;
+        large->magic = 0;
+        pfa_free_frames(large, large->order);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef KMALLOC_H
+#define KMALLOC_H
+
+#include <stddef.h>   // for size_t, NULL
+#include <stdint.h>
+
+/* Smallest and largest kmalloc() size classes. Classes are powers of two;
+   requests above KMALLOC_MAX_SIZE get whole buddy blocks from the frame
+   allocator. */
+#define KMALLOC_MIN_SHIFT 3u     // 8 bytes
+#define KMALLOC_MAX_SHIFT 10u    // 1 KiB
+#define KMALLOC_MAX_SIZE  (1u << KMALLOC_MAX_SHIFT)
+
+/* A cache of equally sized objects. Objects live in slabs (one 4 KiB frame
+   each, header at the start) and free objects are chained through their
+   own first word, so alloc and free are O(1). The calls below are safe
+   from threads and interrupt handlers alike. */
+struct kmem_cache;
+
+// Sets up the kmalloc() size classes. Call once after init_pfa().
+void kmalloc_init(void);
+
+// Creates a cache for objects of the given size. align must be a power of
+// two (0 means pointer alignment). Returns NULL if out of memory.
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align);
+
+// Allocates / frees one object from a cache
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+// Returns every completely free slab of the cache to the frame allocator
+void kmem_cache_shrink(struct kmem_cache *cache);
+
+// General-purpose allocation from the power-of-two size classes. NULL if out
+// of memory or bigger than the largest buddy block (4 MiB, less a header).
+void *kmalloc(size_t size);
+void *kzalloc(size_t size);   // zeroed
+void kfree(void *ptr);
+
+#endif // KMALLOC_H
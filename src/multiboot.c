@@ -0,0 +1,74 @@
+#include "multiboot.h"
+
+/* ===== Helpers ===== */
+static inline uint32_t align_up(uint32_t x, uint32_t a) { return (x + a - 1u) & ~(a - 1u); }
+
+static struct multiboot_tag *first_tag(uint32_t mb_info) {
+    return (struct multiboot_tag *)(uintptr_t)(mb_info + sizeof(struct multiboot_info));
+}
+
+static struct multiboot_tag *next_tag(struct multiboot_tag *tag) {
+    return (struct multiboot_tag *)((uint8_t *)tag + align_up(tag->size, 8));
+}
+
+/* Append [base, base+len) to regions[], clipped to the 32-bit address space. */
+static unsigned int add_region(struct mem_region *regions, unsigned int n, unsigned int max,
+                               uint64_t base, uint64_t len) {
+    uint64_t end = base + len;
+    if (n >= max || base >= 0x100000000ULL || len == 0)
+        return n;
+    if (end > 0x100000000ULL)
+        end = 0x100000000ULL - PFA_PAGE_BYTES;   // keep end representable in 32 bits
+    regions[n].base = (uint32_t)base;
+    regions[n].end  = (uint32_t)end;
+    return n + 1;
+}
+
+/* ===== Public API ===== */
+
+uint32_t multiboot_info_size(uint32_t mb_info) {
+    return ((struct multiboot_info *)(uintptr_t)mb_info)->total_size;
+}
+
+unsigned int multiboot_memory_map(uint32_t mb_info, struct mem_region *regions, unsigned int max_regions) {
+    struct multiboot_tag_basic_meminfo *meminfo = 0;
+    unsigned int n = 0;
+
+    for (struct multiboot_tag *tag = first_tag(mb_info);
+         tag->type != MULTIBOOT_TAG_TYPE_END;
+         tag = next_tag(tag)) {
+
+        if (tag->type == MULTIBOOT_TAG_TYPE_BASIC_MEMINFO) {
+            meminfo = (struct multiboot_tag_basic_meminfo *)tag;
+        } else if (tag->type == MULTIBOOT_TAG_TYPE_MMAP) {
+            struct multiboot_tag_mmap *mmap = (struct multiboot_tag_mmap *)tag;
+            uint8_t *p   = (uint8_t *)mmap->entries;
+            uint8_t *end = (uint8_t *)mmap + mmap->size;
+            for (; p < end; p += mmap->entry_size) {
+                struct multiboot_mmap_entry *e = (struct multiboot_mmap_entry *)p;
+                if (e->type == MULTIBOOT_MEMORY_AVAILABLE)
+                    n = add_region(regions, n, max_regions, e->addr, e->len);
+            }
+        }
+    }
+
+    // No memory map: fall back to "lower" and "upper" memory sizes
+    if (n == 0 && meminfo) {
+        n = add_region(regions, n, max_regions, 0, (uint64_t)meminfo->mem_lower * 1024u);
+        n = add_region(regions, n, max_regions, 0x100000u, (uint64_t)meminfo->mem_upper * 1024u);
+    }
+    return n;
+}
+
+const void *multiboot_acpi_rsdp(uint32_t mb_info) {
+    const void *rsdp = 0;
+    for (struct multiboot_tag *tag = first_tag(mb_info);
+         tag->type != MULTIBOOT_TAG_TYPE_END;
+         tag = next_tag(tag)) {
+        if (tag->type == MULTIBOOT_TAG_TYPE_ACPI_NEW)
+            return tag + 1;
+        if (tag->type == MULTIBOOT_TAG_TYPE_ACPI_OLD)
+            rsdp = tag + 1;
+    }
+    return rsdp;
+}
@@ -0,0 +1,66 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include <stdint.h>
+#include "page.h"   // for struct mem_region
+
+/* ===== Multiboot2 boot information (per the Multiboot2 spec) ===== */
+
+// Value GRUB leaves in EAX when it jumps to a Multiboot2 kernel
+#define MULTIBOOT2_BOOTLOADER_MAGIC 0x36d76289
+
+#define MULTIBOOT_TAG_TYPE_END           0
+#define MULTIBOOT_TAG_TYPE_BASIC_MEMINFO 4
+#define MULTIBOOT_TAG_TYPE_MMAP          6
+#define MULTIBOOT_TAG_TYPE_ACPI_OLD      14   /* copy of the ACPI 1.0 RSDP */
+#define MULTIBOOT_TAG_TYPE_ACPI_NEW      15   /* copy of the ACPI 2.0+ RSDP */
+
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+// Fixed header at the start of the boot information block
+struct multiboot_info {
+    uint32_t total_size;
+    uint32_t reserved;
+} __attribute__((packed));
+
+// Every tag starts with this; tags are padded to 8-byte alignment
+struct multiboot_tag {
+    uint32_t type;
+    uint32_t size;
+} __attribute__((packed));
+
+struct multiboot_tag_basic_meminfo {
+    uint32_t type;
+    uint32_t size;
+    uint32_t mem_lower;   // KiB below 1 MiB
+    uint32_t mem_upper;   // KiB above 1 MiB
+} __attribute__((packed));
+
+struct multiboot_mmap_entry {
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+    uint32_t zero;
+} __attribute__((packed));
+
+struct multiboot_tag_mmap {
+    uint32_t type;
+    uint32_t size;
+    uint32_t entry_size;
+    uint32_t entry_version;
+    struct multiboot_mmap_entry entries[];
+} __attribute__((packed));
+
+/* Fill regions[] with the usable RAM ranges reported by the bootloader,
+   clipped to 32-bit addresses. Falls back to the basic meminfo tag when
+   there is no memory map. Returns the number of regions written. */
+unsigned int multiboot_memory_map(uint32_t mb_info, struct mem_region *regions, unsigned int max_regions);
+
+// Size in bytes of the boot information block (so it can be reserved)
+uint32_t multiboot_info_size(uint32_t mb_info);
+
+// The bootloader's copy of the ACPI RSDP (the 2.0+ one if both are there),
+// or NULL if it passed none
+const void *multiboot_acpi_rsdp(uint32_t mb_info);
+
+#endif /* MULTIBOOT_H */
@@ -1,100 +1,347 @@
 #include "page.h"
+#include "kmalloc.h"
+#include "interrupt.h"
 
-// Static descriptor array (128 * 2 MiB = 256 MiB of pages)
-static struct ppage physical_page_array[128];
+/* Free frames are tracked one bit per 4 KiB frame (1 = free) in a two-level
+   bitmap. Each leaf word covers 32 frames; the summary words hold one bit
+   per leaf word:
+     frame_any[]  - leaf word has at least one free frame
+     frame_full[] - leaf word is entirely free
+   A single free frame is found with one bit-scan in frame_any[] and one in
+   the leaf. Naturally aligned buddy blocks of up to 32 frames are found
+   inside one leaf word; larger blocks are found as aligned runs of bits in
+   frame_full[]. Freeing just sets bits, so buddies coalesce on their own. */
 
-// Global free list head
-struct ppage *free_list_head = NULL;
+#define BITS_PER_WORD 32u
+
+static uint32_t *frame_bitmap = NULL;   // leaf level
+static uint32_t *frame_any = NULL;      // summary: any free
+static uint32_t *frame_full = NULL;     // summary: all free
+static uint16_t *frame_refs = NULL;     // extra references per frame (COW sharing)
+
+// A count that reaches this sticks: the frame is never freed
+#define FRAME_REFS_MAX 0xFFFFu
+static unsigned int leaf_words = 0;
+static unsigned int summary_words = 0;
+static unsigned int total_frames = 0;
+static unsigned int free_pages = 0;
+
+// Lowest summary word that may still have a bit set in frame_any[]
+static unsigned int search_hint = 0;
+
+// Block descriptors for the allocate_physical_pages() list API
+static struct kmem_cache *ppage_cache = NULL;
 
 /* ---------- Internal helpers ---------- */
 
-static void list_push_front(struct ppage **head, struct ppage *node) {
-    node->prev = NULL;
-    node->next = *head;
-    if (*head)
-        (*head)->prev = node;
-    *head = node;
+static inline uint32_t align_up(uint32_t x, uint32_t a) { return (x + a - 1u) & ~(a - 1u); }
+static inline uint32_t align_down(uint32_t x, uint32_t a) { return x & ~(a - 1u); }
+
+/* Bits set at the start of every naturally aligned run of 2^order set bits
+   in w (order <= 5). */
+static uint32_t run_starts(uint32_t w, unsigned int order) {
+    static const uint32_t aligned[6] = {
+        0xFFFFFFFFu, 0x55555555u, 0x11111111u, 0x01010101u, 0x00010001u, 0x00000001u
+    };
+    for (unsigned int s = 1; s < (1u << order); s <<= 1)
+        w &= w >> s;
+    return w & aligned[order];
 }
 
-static struct ppage *list_pop_front(struct ppage **head) {
-    if (!*head)
-        return NULL;
-    struct ppage *n = *head;
-    *head = n->next;
-    if (*head)
-        (*head)->prev = NULL;
-    n->next = n->prev = NULL;
-    return n;
+/* Refresh both summary bits for leaf word wi. */
+static void update_summary(unsigned int wi) {
+    unsigned int si  = wi / BITS_PER_WORD;
+    uint32_t     bit = 1u << (wi % BITS_PER_WORD);
+    uint32_t     w   = frame_bitmap[wi];
+
+    if (w) frame_any[si] |= bit;
+    else   frame_any[si] &= ~bit;
+
+    if (w == 0xFFFFFFFFu) frame_full[si] |= bit;
+    else                  frame_full[si] &= ~bit;
 }
 
-static struct ppage *list_tail(struct ppage *head) {
-    while (head && head->next)
-        head = head->next;
-    return head;
+/* Set (free) or clear (allocate) the bits of a naturally aligned block. */
+static void mark_block(unsigned int frame, unsigned int order, int free) {
+    if (order < 5) {
+        unsigned int wi   = frame / BITS_PER_WORD;
+        uint32_t     mask = ((1u << (1u << order)) - 1u) << (frame % BITS_PER_WORD);
+        if (free) frame_bitmap[wi] |= mask;
+        else      frame_bitmap[wi] &= ~mask;
+        update_summary(wi);
+    } else {
+        unsigned int wi = frame / BITS_PER_WORD;
+        for (unsigned int n = 1u << (order - 5); n; --n, ++wi) {
+            frame_bitmap[wi] = free ? 0xFFFFFFFFu : 0;
+            update_summary(wi);
+        }
+    }
+    if (free && frame / (BITS_PER_WORD * BITS_PER_WORD) < search_hint)
+        search_hint = frame / (BITS_PER_WORD * BITS_PER_WORD);
 }
 
-static unsigned int list_length(struct ppage *head) {
-    unsigned int count = 0;
-    while (head) {
-        count++;
-        head = head->next;
+/* Mark every frame in [base, end) free or allocated, one frame at a time.
+   Only used while building the bitmap. */
+static void mark_range(uint32_t base, uint32_t end, int free) {
+    if (end > (uint32_t)total_frames << PFA_PAGE_SHIFT)
+        end = (uint32_t)total_frames << PFA_PAGE_SHIFT;
+    for (uint32_t a = base; a < end; a += PFA_PAGE_BYTES) {
+        unsigned int f = a >> PFA_PAGE_SHIFT;
+        if (free) frame_bitmap[f / BITS_PER_WORD] |= 1u << (f % BITS_PER_WORD);
+        else      frame_bitmap[f / BITS_PER_WORD] &= ~(1u << (f % BITS_PER_WORD));
     }
-    return count;
 }
 
-/* ---------- Public API ---------- */
+/* Find the first free naturally aligned block of 2^order frames;
+   returns its frame number or -1. */
+static int find_block(unsigned int order) {
+    if (order <= 5) {
+        for (unsigned int si = search_hint; si < summary_words; ++si) {
+            uint32_t sw = frame_any[si];
+            if (!sw) {
+                if (si == search_hint)
+                    search_hint++;   // nothing free below here any more
+                continue;
+            }
+            while (sw) {
+                unsigned int wi = si * BITS_PER_WORD + __builtin_ctz(sw);
+                uint32_t m = run_starts(frame_bitmap[wi], order);
+                if (m)
+                    return (int)(wi * BITS_PER_WORD + __builtin_ctz(m));
+                sw &= sw - 1u;
+            }
+        }
+        return -1;
+    }
+
+    for (unsigned int si = 0; si < summary_words; ++si) {
+        uint32_t m = run_starts(frame_full[si], order - 5);
+        if (m)
+            return (int)((si * BITS_PER_WORD + __builtin_ctz(m)) * BITS_PER_WORD);
+    }
+    return -1;
+}
+
+static int overlaps(uint32_t a0, uint32_t a1, const struct mem_region *r) {
+    return a0 < r->end && r->base < a1;
+}
+
+/* Find bytes of usable RAM below PFA_PHYS_LIMIT that miss every reserved range. */
+static uint32_t find_hole(uint32_t bytes,
+                          const struct mem_region *usable, unsigned int nusable,
+                          const struct mem_region *reserved, unsigned int nreserved) {
+    for (unsigned int i = 0; i < nusable; ++i) {
+        uint32_t cand = align_up(usable[i].base ? usable[i].base : PFA_PAGE_BYTES, PFA_PAGE_BYTES);
+        uint32_t end  = usable[i].end < PFA_PHYS_LIMIT ? usable[i].end : PFA_PHYS_LIMIT;
+        unsigned int r = 0;
+        while (r < nreserved && cand + bytes <= end) {
+            if (overlaps(cand, cand + bytes, &reserved[r])) {
+                cand = align_up(reserved[r].end, PFA_PAGE_BYTES);
+                r = 0;   // moved past one range, recheck them all
+            } else {
+                r++;
+            }
+        }
+        if (cand + bytes <= end && cand >= usable[i].base)
+            return cand;
+    }
+    return 0;
+}
 
-void init_pfa_list(void) {
-    free_list_head = NULL;
-    for (unsigned int i = 0; i < (sizeof(physical_page_array) / sizeof(physical_page_array[0])); ++i) {
-        struct ppage *pp = &physical_page_array[i];
+static struct ppage *ppage_get(void) {
+    uint32_t flags = irq_save();
+    if (!ppage_cache)
+        ppage_cache = kmem_cache_create("ppage", sizeof(struct ppage), 0);
+    irq_restore(flags);
+    struct ppage *pp = ppage_cache ? kmem_cache_alloc(ppage_cache) : NULL;
+    if (pp)
         pp->next = pp->prev = NULL;
-        pp->physical_addr = (void *)(uintptr_t)(i * (uintptr_t)PFA_PAGE_BYTES);
-        list_push_front(&free_list_head, pp);
+    return pp;
+}
+
+static void ppage_put(struct ppage *pp) {
+    kmem_cache_free(ppage_cache, pp);
+}
+
+/* ---------- Public API ---------- */
+
+void init_pfa(const struct mem_region *usable, unsigned int nusable,
+              const struct mem_region *reserved, unsigned int nreserved) {
+    // Size the bitmap from the top of usable RAM
+    uint32_t top = 0;
+    for (unsigned int i = 0; i < nusable; ++i)
+        if (usable[i].end > top)
+            top = usable[i].end;
+    if (top > PFA_PHYS_LIMIT)
+        top = PFA_PHYS_LIMIT;
+
+    total_frames  = top >> PFA_PAGE_SHIFT;
+    leaf_words    = (total_frames + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    // Round up to a whole summary word so multi-word blocks never run off the end
+    leaf_words    = align_up(leaf_words, BITS_PER_WORD);
+    summary_words = leaf_words / BITS_PER_WORD;
+
+    uint32_t bitmap_bytes = (leaf_words + 2 * summary_words) * sizeof(uint32_t);
+    uint32_t bytes = bitmap_bytes + align_up(total_frames * sizeof(uint16_t), sizeof(uint32_t));
+    uint32_t where = find_hole(bytes, usable, nusable, reserved, nreserved);
+
+    free_pages  = 0;
+    search_hint = 0;
+    if (!where) {
+        total_frames = leaf_words = summary_words = 0;
+        return;
+    }
+
+    frame_bitmap = (uint32_t *)(uintptr_t)where;
+    frame_any    = frame_bitmap + leaf_words;
+    frame_full   = frame_any + summary_words;
+    frame_refs   = (uint16_t *)(uintptr_t)(where + bitmap_bytes);
+    for (unsigned int i = 0; i < bytes / sizeof(uint32_t); ++i)
+        frame_bitmap[i] = 0;
+
+    // Free usable RAM, then take back the reserved ranges and our own bitmaps
+    for (unsigned int i = 0; i < nusable; ++i)
+        mark_range(align_up(usable[i].base, PFA_PAGE_BYTES),
+                   align_down(usable[i].end, PFA_PAGE_BYTES), 1);
+    for (unsigned int i = 0; i < nreserved; ++i)
+        mark_range(align_down(reserved[i].base, PFA_PAGE_BYTES), reserved[i].end, 0);
+    mark_range(where, where + bytes, 0);
+    mark_range(0, PFA_PAGE_BYTES, 0);   // never hand out physical address 0
+
+    for (unsigned int wi = 0; wi < leaf_words; ++wi) {
+        update_summary(wi);
+        for (uint32_t w = frame_bitmap[wi]; w; w &= w - 1u)
+            free_pages++;
     }
 }
 
+/* The bitmaps and reference counts are shared with interrupt handlers
+   (the slab allocator runs on top of them) and preemptible threads, so
+   each entry point below runs with interrupts off. */
+
+void *pfa_alloc_frames(unsigned int order) {
+    if (order > PFA_MAX_ORDER)
+        return NULL;
+    uint32_t flags = irq_save();
+    int frame = find_block(order);
+    if (frame >= 0) {
+        mark_block((unsigned int)frame, order, 0);
+        free_pages -= 1u << order;
+    }
+    irq_restore(flags);
+    if (frame < 0)
+        return NULL;
+    return (void *)((uintptr_t)frame << PFA_PAGE_SHIFT);
+}
+
+void pfa_free_frames(void *physical_addr, unsigned int order) {
+    if (!physical_addr || order > PFA_MAX_ORDER)
+        return;
+    uint32_t flags = irq_save();
+    frame_refs[(uint32_t)(uintptr_t)physical_addr >> PFA_PAGE_SHIFT] = 0;
+    mark_block((uint32_t)(uintptr_t)physical_addr >> PFA_PAGE_SHIFT, order, 1);
+    free_pages += 1u << order;
+    irq_restore(flags);
+}
+
+void pfa_frame_get(void *physical_addr) {
+    uint16_t *refs = &frame_refs[(uint32_t)(uintptr_t)physical_addr >> PFA_PAGE_SHIFT];
+    uint32_t flags = irq_save();
+    if (*refs < FRAME_REFS_MAX)
+        (*refs)++;
+    irq_restore(flags);
+}
+
+void pfa_frame_put(void *physical_addr) {
+    uint16_t *refs = &frame_refs[(uint32_t)(uintptr_t)physical_addr >> PFA_PAGE_SHIFT];
+    uint32_t flags = irq_save();
+    // A saturated count is unknown, so that frame is leaked
+    if (*refs != FRAME_REFS_MAX) {
+        if (*refs)
+            (*refs)--;
+        else
+            pfa_free_frames(physical_addr, 0);
+    }
+    irq_restore(flags);
+}
+
+int pfa_frame_shared(void *physical_addr) {
+    return frame_refs[(uint32_t)(uintptr_t)physical_addr >> PFA_PAGE_SHIFT] != 0;
+}
+
 struct ppage *allocate_physical_pages(unsigned int npages) {
-    if (npages == 0)
+    if (npages == 0 || npages > free_pages)
         return NULL;
 
     struct ppage *alloc_head = NULL;
     struct ppage *alloc_tail = NULL;
+    unsigned int remaining = npages;
+    unsigned int order = PFA_MAX_ORDER;
+
+    while (remaining) {
+        while ((1u << order) > remaining)
+            order--;
+
+        void *pa = pfa_alloc_frames(order);
+        if (!pa) {
+            if (order == 0)
+                goto fail;
+            order--;   // fall back to smaller blocks
+            continue;
+        }
 
-    for (unsigned int i = 0; i < npages; ++i) {
-        struct ppage *page = list_pop_front(&free_list_head);
-        if (!page) {
-            // Roll back already allocated pages
-            if (alloc_head)
-                free_physical_pages(alloc_head);
-            return NULL;
+        struct ppage *block = ppage_get();
+        if (!block) {
+            pfa_free_frames(pa, order);
+            goto fail;
         }
+        block->physical_addr = pa;
+        block->order = (uint8_t)order;
 
         if (!alloc_head)
-            alloc_head = alloc_tail = page;
+            alloc_head = alloc_tail = block;
         else {
-            alloc_tail->next = page;
-            page->prev = alloc_tail;
-            alloc_tail = page;
+            alloc_tail->next = block;
+            block->prev = alloc_tail;
+            alloc_tail = block;
         }
+        remaining -= 1u << order;
     }
 
     return alloc_head;
-}
 
-void free_physical_pages(struct ppage *ppage_list) {
-    if (!ppage_list)
-        return;
+fail:
+    // Roll back already allocated blocks
+    free_physical_pages(alloc_head);
+    return NULL;
+}
 
-    struct ppage *tail = list_tail(ppage_list);
-    tail->next = free_list_head;
-    if (free_list_head)
-        free_list_head->prev = tail;
+struct ppage *allocate_contiguous(unsigned int order) {
+    struct ppage *block = ppage_get();
+    if (!block)
+        return NULL;
+    block->physical_addr = pfa_alloc_frames(order);
+    if (!block->physical_addr) {
+        ppage_put(block);
+        return NULL;
+    }
+    block->order = (uint8_t)order;
+    return block;
+}
 
-    ppage_list->prev = NULL;
-    free_list_head = ppage_list;
+void free_physical_pages(struct ppage *ppage_list) {
+    while (ppage_list) {
+        struct ppage *next = ppage_list->next;
+        pfa_free_frames(ppage_list->physical_addr, ppage_list->order);
+        ppage_put(ppage_list);
+        ppage_list = next;
+    }
 }
 
 unsigned int pfa_free_count(void) {
-    return list_length(free_list_head);
+    return free_pages;
+}
+
+unsigned int pfa_total_count(void) {
+    return total_frames;
 }
@@ -4,29 +4,72 @@
 #include <stddef.h>   // for size_t, NULL
 #include <stdint.h>   // for uintptr_t, uint32_t
 
-// Each page is 2 MiB
-#define PFA_PAGE_BYTES (2u * 1024u * 1024u)
+// Each page frame is 4 KiB
+#define PFA_PAGE_BYTES 4096u
+#define PFA_PAGE_SHIFT 12u
 
-// Page descriptor structure
+// Largest buddy block is 2^PFA_MAX_ORDER pages (4 MiB)
+#define PFA_MAX_ORDER 10u
+
+// Highest physical address the allocator will hand out. Every frame must be
+// identity-mapped by main(); virtual addresses above this are left free for
+// non-identity mappings.
+#define PFA_PHYS_LIMIT 0x38000000u
+
+// A physical address range [base, end)
+struct mem_region {
+    uint32_t base;
+    uint32_t end;
+};
+
+// Block descriptor handed out by allocate_physical_pages(). Free memory is
+// tracked in a bitmap, so these only exist for blocks that are in use; they
+// come from a slab cache (see kmalloc.h), so kmalloc_init() must have run.
 struct ppage {
-    struct ppage *next;   // next page in list
-    struct ppage *prev;   // previous page in list
-    void *physical_addr;  // physical start address of this page
+    struct ppage *next;   // next block in list
+    struct ppage *prev;   // previous block in list
+    void *physical_addr;  // physical start address of this block
+    uint8_t order;        // block spans (1 << order) pages
 };
 
-// Global head of the free list (defined in page.c)
-extern struct ppage *free_list_head;
+// Builds the frame bitmap over the usable[] RAM ranges, leaving the reserved[]
+// ranges (kernel image, boot info, ...) allocated. The bitmap (and the
+// per-frame reference counts) are placed in usable RAM that doesn't overlap
+// anything reserved.
+void init_pfa(const struct mem_region *usable, unsigned int nusable,
+              const struct mem_region *reserved, unsigned int nreserved);
 
-// Initializes the allocator and builds the free list
-void init_pfa_list(void);
+// Allocates a naturally aligned block of (1 << order) contiguous frames and
+// returns its physical address, or NULL if none is free. This and the
+// calls below are safe from threads and interrupt handlers alike.
+void *pfa_alloc_frames(unsigned int order);
 
-// Allocates npages from the free list
+// Frees a block returned by pfa_alloc_frames()
+void pfa_free_frames(void *physical_addr, unsigned int order);
+
+// Per-frame reference counts for frames mapped in several address spaces
+// (copy-on-write). A frame fresh from pfa_alloc_frames() has one reference.
+// Past 65535 extra references the count saturates and the frame is never
+// freed.
+void pfa_frame_get(void *physical_addr);     // add a reference
+void pfa_frame_put(void *physical_addr);     // drop one; frees the frame on the last
+int  pfa_frame_shared(void *physical_addr);  // more than one reference?
+
+// Allocates npages as a list of buddy blocks (largest blocks first).
+// Walk the list and use each node's order to get the block size.
 struct ppage *allocate_physical_pages(unsigned int npages);
 
-// Frees a list of physical pages
+// Allocates a single physically contiguous block of (1 << order) pages
+struct ppage *allocate_contiguous(unsigned int order);
+
+// Frees a list of blocks returned by allocate_physical_pages() or
+// allocate_contiguous()
 void free_physical_pages(struct ppage *ppage_list);
 
-// Returns the number of pages currently on the free list
+// Returns the number of pages currently free
 unsigned int pfa_free_count(void);
 
+// Returns the number of pages managed by the allocator
+unsigned int pfa_total_count(void);
+
 #endif // PAGE_H
@@ -1,9 +1,10 @@
 #include "paging.h"
+#include "cpu.h"
+#include "page.h"
 
 /* ===== Global paging structures (must be global + 4096-aligned) ===== */
 struct page_directory_entry kernel_pd[PD_ENTRIES] __attribute__((aligned(4096)));
-struct page kernel_pt_pool[PT_POOL_COUNT][PT_ENTRIES] __attribute__((aligned(4096)));
-static uint32_t kernel_pt_count = 0;
+static int pse_enabled = 0;
 
 /* ===== Helpers ===== */
 static inline uint32_t align_down(uint32_t x, uint32_t a) { return x & ~(a - 1u); }
@@ -21,45 +22,91 @@ static inline void invlpg(void *addr) {
     __asm__ __volatile__("invlpg (%0)" :: "r"(addr) : "memory");
 }
 
-/* Create (& zero) a new page table from the static pool; return NULL if pool exhausted. */
-static struct page* alloc_pt_from_pool(void) {
-    if (kernel_pt_count >= PT_POOL_COUNT) return 0;
-    struct page *pt = &kernel_pt_pool[kernel_pt_count++][0];
-    bzero_bytes(pt, sizeof(kernel_pt_pool[0]));
-    return pt;
+static inline uint32_t read_cr3(void) {
+    uint32_t v;
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(v));
+    return v;
 }
 
-/* Ensure a PT exists for the given PDE index.
-   If absent, allocate one from the pool and wire the PDE for 4KiB pages. */
-static struct page* ensure_pt(struct page_directory_entry *pd, uint32_t pdi) {
-    if (pd[pdi].present) {
-        uint32_t pt_phys = pd[pdi].frame << 12;
-        return (struct page*)pt_phys;  // prior to paging, identity assumption is fine
-    }
-    struct page *pt = alloc_pt_from_pool();
+/* Create (& zero) a new page table from the frame allocator; return NULL if out of memory.
+   Frames are identity-mapped, so the physical address is also usable as a pointer. */
+static struct page* alloc_pt(void) {
+    struct page *pt = (struct page*)pfa_alloc_frames(0);
     if (!pt) return 0;
+    bzero_bytes(pt, PT_ENTRIES * sizeof(struct page));
+    return pt;
+}
 
+/* Drop a reference on a page table. Kernel tables below KERNEL_VA_BASE are
+   shared with clone_address_space() copies, so the last one frees it. */
+static void free_pt(struct page *pt) {
+    pfa_frame_put(pt);
+}
+
+static int pt_is_empty(const struct page *pt) {
+    const uint32_t *e = (const uint32_t*)pt;
+    for (uint32_t i = 0; i < PT_ENTRIES; ++i)
+        if (e[i]) return 0;
+    return 1;
+}
+
+/* Point PDE[pdi] at a page table (pagesize = 0) or at a 4 MiB page (pagesize = 1). */
+static void pde_set(struct page_directory_entry *pd, uint32_t pdi, uint32_t phys, uint32_t pagesize) {
     pd[pdi].present       = 1;
     pd[pdi].rw            = 1;
     pd[pdi].user          = 0;
     pd[pdi].writethru     = 0;
     pd[pdi].cachedisabled = 0;
     pd[pdi].accessed      = 0;
-    pd[pdi].pagesize      = 0;                 // 4 KiB pages
+    pd[pdi].pagesize      = pagesize;
     pd[pdi].ignored       = 0;
     pd[pdi].os_specific   = 0;
-    pd[pdi].frame         = ((uint32_t)(uintptr_t)pt) >> 12; // physical >> 12
+    pd[pdi].frame         = phys >> 12;        // physical >> 12
+}
+
+/* Replace a 4 MiB PDE with a page table that maps the same 1024 frames,
+   so individual 4 KiB pages inside it can be changed. */
+static struct page* split_large_pde(struct page_directory_entry *pd, uint32_t pdi) {
+    struct page *pt = alloc_pt();
+    if (!pt) return 0;
 
+    uint32_t base_frame = pd[pdi].frame;       // 4 MiB aligned, so low 10 bits are 0
+    for (uint32_t i = 0; i < PT_ENTRIES; ++i) {
+        pt[i].present = 1;
+        pt[i].rw      = pd[pdi].rw;
+        pt[i].user    = pd[pdi].user;
+        pt[i].frame   = base_frame + i;
+    }
+    pde_set(pd, pdi, (uint32_t)(uintptr_t)pt, 0);
+    invlpg((void*)(pdi << 22));
     return pt;
 }
 
-/* Map a single 4 KiB page: VA -> PA (helper for map_pages) */
-static void map_4k(struct page_directory_entry *pd, uint32_t va, uint32_t pa) {
+/* Ensure a PT exists for the given PDE index.
+   If absent, allocate one from the frame allocator and wire the PDE for 4KiB pages;
+   if the PDE maps a 4 MiB page, split it. */
+static struct page* ensure_pt(struct page_directory_entry *pd, uint32_t pdi) {
+    if (pd[pdi].present && pd[pdi].pagesize)
+        return split_large_pde(pd, pdi);
+    if (pd[pdi].present) {
+        uint32_t pt_phys = pd[pdi].frame << 12;
+        return (struct page*)pt_phys;  // page tables are identity-mapped
+    }
+    struct page *pt = alloc_pt();
+    if (!pt) return 0;
+
+    pde_set(pd, pdi, (uint32_t)(uintptr_t)pt, 0); // 4 KiB pages
+    return pt;
+}
+
+/* Map a single 4 KiB page: VA -> PA (helper for map_pages).
+   Returns 0 on success, -1 if a page table couldn't be allocated. */
+static int map_4k(struct page_directory_entry *pd, uint32_t va, uint32_t pa) {
     uint32_t pdi = vaddr_pdi(va);
     uint32_t pti = vaddr_pti(va);
 
     struct page *pt = ensure_pt(pd, pdi);
-    if (!pt) return; // out of PTs, silently drop
+    if (!pt) return -1; // out of memory for page tables
 
     pt[pti].present  = 1;
     pt[pti].rw       = 1;
@@ -68,30 +115,70 @@ static void map_4k(struct page_directory_entry *pd, uint32_t va, uint32_t pa) {
     pt[pti].dirty    = 0;
     pt[pti].unused   = 0;
     pt[pti].frame    = (pa >> 12);
+    return 0;
 }
 
-/* ===== Assignment function: map a linked list of physical pages at vaddr ===== */
+/* ===== Assignment function: map a linked list of physical blocks at vaddr =====
+   Each node is a buddy block of (PFA_PAGE_BYTES << order) contiguous bytes. */
 void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd) {
     uint32_t va = align_down((uint32_t)(uintptr_t)vaddr, PAGE_SIZE);
+    struct tlb_gather tlb;
+    void *ret = (void*)va;
 
+    tlb_gather_init(&tlb, pd);
     for (struct ppage *cur = pglist; cur; cur = cur->next) {
-        uint32_t pa_base = (uint32_t)(uintptr_t)cur->physical_addr;
-        for (uint32_t off = 0; off < PFA_PAGE_BYTES; off += PAGE_SIZE) {
-            map_4k(pd, va, pa_base + off);
+        uint32_t npages = 1u << cur->order;
+        if (map_range(&tlb, va, (uint32_t)(uintptr_t)cur->physical_addr, npages, PTE_RW) < 0) {
+            ret = 0;
+            break;
+        }
+        va += npages * PAGE_SIZE;
+    }
+    tlb_finish(&tlb);
+    return ret;
+}
+
+/* ===== Large (4 MiB) pages ===== */
+int paging_enable_pse(void) {
+    if (!cpu_has(CPU_FEATURE_PSE))
+        return 0;
+    write_cr4(read_cr4() | CR4_PSE);
+    pse_enabled = 1;
+    return 1;
+}
+
+int map_physical_range(struct page_directory_entry *pd, uint32_t va, uint32_t pa, uint32_t bytes) {
+    uint32_t end = va + bytes;
+    va = align_down(va, PAGE_SIZE);
+    pa = align_down(pa, PAGE_SIZE);
+
+    while (va < end) {
+        uint32_t pdi = vaddr_pdi(va);
+        // A whole, aligned 4 MiB chunk that isn't already split into 4 KiB pages
+        if (pse_enabled && !(va & (LARGE_PAGE_SIZE - 1)) && !(pa & (LARGE_PAGE_SIZE - 1)) &&
+            end - va >= LARGE_PAGE_SIZE && !(pd[pdi].present && !pd[pdi].pagesize)) {
+            pde_set(pd, pdi, pa, 1);
+            va += LARGE_PAGE_SIZE;
+            pa += LARGE_PAGE_SIZE;
+        } else {
+            if (map_4k(pd, va, pa) < 0) return -1;
             va += PAGE_SIZE;
+            pa += PAGE_SIZE;
         }
+        if (va == 0) break;   // wrapped past 4 GiB
     }
-    return (void*)align_down((uint32_t)(uintptr_t)vaddr, PAGE_SIZE);
+    return 0;
 }
 
-/* ===== Control registers ===== */
+/* ===== Control registers =====
+   CR0.WP is set too, so read-only (e.g. copy-on-write) pages fault on kernel writes. */
 void loadPageDirectory(struct page_directory_entry *pd) {
     __asm__ __volatile__("mov %0, %%cr3" :: "r"(pd) : "memory");
 }
 void enablePaging(void) {
     __asm__ __volatile__(
         "mov %%cr0, %%eax\n"
-        "or  $0x80000001, %%eax\n"  /* CR0.PE | CR0.PG */
+        "or  $0x80010001, %%eax\n"  /* CR0.PE | CR0.WP | CR0.PG */
         "mov %%eax, %%cr0\n"
         ::: "eax", "memory"
     );
@@ -115,6 +202,7 @@ void paging_init_recursive(struct page_directory_entry *pd) {
    Requires: paging enabled AND paging_init_recursive() called before CR3 load. */
 
 static inline int is_present(uint32_t entry) { return entry & 0x001; }
+static inline int is_large(uint32_t entry)   { return entry & 0x080; }
 
 /* Translate VA -> PA; returns NULL if PDE/PTE not present. */
 void *get_physaddr(void *virtualaddr) {
@@ -124,6 +212,8 @@ void *get_physaddr(void *virtualaddr) {
 
     volatile unsigned long *pd = (unsigned long *)0xFFFFF000; // PD via recursive map
     if (!is_present(pd[pdindex])) return (void*)0;
+    if (is_large(pd[pdindex]))    // 4 MiB page: no page table
+        return (void *)((pd[pdindex] & ~0x3FFFFFUL) + (va & 0x3FFFFFUL));
 
     volatile unsigned long *pt = (unsigned long *)0xFFC00000 + (0x400 * pdindex);
     if (!is_present(pt[ptindex])) return (void*)0;
@@ -134,7 +224,7 @@ void *get_physaddr(void *virtualaddr) {
 }
 
 /* Map exactly one 4 KiB page: physaddr -> virtualaddr with low 12-bit flags.
-   If the PT is missing, allocate from the static pool and wire the PDE. */
+   If the PT is missing, allocate one from the frame allocator and wire the PDE. */
 int map_page(void *physaddr, void *virtualaddr, unsigned int flags) {
     unsigned long pa = (unsigned long)physaddr;
     unsigned long va = (unsigned long)virtualaddr;
@@ -147,13 +237,16 @@ int map_page(void *physaddr, void *virtualaddr, unsigned int flags) {
     // Access PD via recursive map
     volatile unsigned long *pd = (unsigned long *)0xFFFFF000;
 
-    // If PDE is absent, create a new PT from our pool and wire it
+    // If PDE is absent, create a new PT and wire it
     if (!is_present(pd[pdindex])) {
-        struct page *newpt = alloc_pt_from_pool();
-        if (!newpt) return -2; // out of PTs
+        struct page *newpt = alloc_pt();
+        if (!newpt) return -2; // out of memory for page tables
         // Zero already done in allocator; now wire PDE (present|rw, user=0, 4KiB)
         pd[pdindex] = (((unsigned long)(uintptr_t)newpt) & ~0xFFFUL) | 0x003UL;
         // After this write, that PT appears at 0xFFC00000 + pdindex*0x1000 immediately
+    } else if (is_large(pd[pdindex])) {
+        // Break the 4 MiB page into a PT so one 4 KiB page in it can change
+        if (!split_large_pde((struct page_directory_entry *)pd, pdindex)) return -2;
     }
 
     volatile unsigned long *pt = (unsigned long *)0xFFC00000 + (0x400 * pdindex);
@@ -165,3 +258,307 @@ int map_page(void *physaddr, void *virtualaddr, unsigned int flags) {
     invlpg((void*)va);
     return 0;
 }
+
+/* Unmap exactly one 4 KiB page. If that leaves a page table below
+   KERNEL_VA_BASE empty, the PDE is cleared and the table is released. */
+int unmap_page(void *virtualaddr) {
+    unsigned long va = (unsigned long)virtualaddr;
+    if (va & 0xFFFUL) return -1;
+
+    unsigned long pdindex = va >> 22;
+    unsigned long ptindex = (va >> 12) & 0x03FF;
+
+    volatile unsigned long *pd = (unsigned long *)0xFFFFF000;
+    if (!is_present(pd[pdindex])) return -3;   // nothing mapped here
+    if (is_large(pd[pdindex])) {
+        if (!split_large_pde((struct page_directory_entry *)pd, pdindex)) return -2;
+    }
+
+    volatile unsigned long *pt = (unsigned long *)0xFFC00000 + (0x400 * pdindex);
+    if (!is_present(pt[ptindex])) return -3;
+
+    pt[ptindex] = 0;
+    invlpg((void*)va);
+
+    // Kernel VA tables are shared by every address space and stay allocated
+    if (pdindex < vaddr_pdi(KERNEL_VA_BASE) && pt_is_empty((const struct page *)pt)) {
+        struct page *pt_phys = (struct page *)(pd[pdindex] & ~0xFFFUL);
+        pd[pdindex] = 0;
+        // Drop the stale recursive-map translation of the table, then free it
+        invlpg((void*)pt);
+        free_pt(pt_phys);
+    }
+    return 0;
+}
+
+/* ===== Batched mapping with deferred TLB invalidation ===== */
+
+/* Remember that va's translation changed. Past TLB_GATHER_MAX addresses we
+   stop recording and flush everything with a CR3 reload instead. */
+static void tlb_add(struct tlb_gather *tlb, uint32_t va) {
+    if (tlb->full_flush) return;
+    if (tlb->nr == TLB_GATHER_MAX) {
+        tlb->full_flush = 1;
+        return;
+    }
+    tlb->va[tlb->nr++] = va;
+}
+
+/* Queue a 4 KiB frame to be freed once the TLB has been flushed. Unshared
+   frames are dead, so the first word holds the list link; a frame another
+   address space still uses just drops its reference right away. */
+static void tlb_defer_free(struct tlb_gather *tlb, void *frame) {
+    if (pfa_frame_shared(frame)) {
+        pfa_frame_put(frame);
+        return;
+    }
+    *(void **)frame = tlb->free_frames;
+    tlb->free_frames = frame;
+}
+
+/* Existing PT for va, or NULL; 4 MiB PDEs are split first. */
+static struct page* lookup_pt(struct page_directory_entry *pd, uint32_t pdi, int *err) {
+    *err = 0;
+    if (!pd[pdi].present) return 0;
+    if (pd[pdi].pagesize) {
+        struct page *pt = split_large_pde(pd, pdi);
+        if (!pt) *err = -1;
+        return pt;
+    }
+    return (struct page*)(pd[pdi].frame << 12);
+}
+
+void tlb_gather_init(struct tlb_gather *tlb, struct page_directory_entry *pd) {
+    tlb->pd = pd;
+    tlb->nr = 0;
+    tlb->full_flush = 0;
+    tlb->free_frames = 0;
+}
+
+int map_range(struct tlb_gather *tlb, uint32_t va, uint32_t pa, uint32_t npages, unsigned int flags) {
+    struct page_directory_entry *pd = tlb->pd;
+    va = align_down(va, PAGE_SIZE);
+    pa = align_down(pa, PAGE_SIZE);
+
+    for (uint32_t i = 0; i < npages; ++i, va += PAGE_SIZE, pa += PAGE_SIZE) {
+        uint32_t pdi = vaddr_pdi(va);
+        struct page *pt = ensure_pt(pd, pdi);
+        if (!pt) return -1; // out of memory for page tables
+        if (flags & PTE_USER) pd[pdi].user = 1;
+
+        uint32_t *pte = (uint32_t*)pt + vaddr_pti(va);
+        if (*pte & PTE_PRESENT) tlb_add(tlb, va);   // not-present entries are never cached
+        *pte = pa | (flags & 0xFFFu) | PTE_PRESENT;
+    }
+    return 0;
+}
+
+int unmap_range(struct tlb_gather *tlb, uint32_t va, uint32_t npages, int free_frames) {
+    struct page_directory_entry *pd = tlb->pd;
+    uint32_t end = align_down(va, PAGE_SIZE) + npages * PAGE_SIZE;
+    int ret = 0;
+    va = align_down(va, PAGE_SIZE);
+
+    while (va < end) {
+        uint32_t pdi = vaddr_pdi(va);
+        uint32_t next = align_down(va, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE;
+        if (next > end || next == 0) next = end;
+
+        if (!pd[pdi].present) { va = next; continue; }
+
+        // A whole 4 MiB page goes away in one PDE write
+        if (pd[pdi].pagesize && !(va & (LARGE_PAGE_SIZE - 1)) && next - va == LARGE_PAGE_SIZE) {
+            *(uint32_t*)&pd[pdi] = 0;
+            tlb_add(tlb, va);
+            va = next;
+            continue;
+        }
+
+        int err;
+        struct page *pt = lookup_pt(pd, pdi, &err);
+        if (!pt) {
+            if (err) ret = -1;   // couldn't split the 4 MiB page: left mapped
+            va = next;
+            continue;
+        }
+
+        for (; va < next; va += PAGE_SIZE) {
+            uint32_t *pte = (uint32_t*)pt + vaddr_pti(va);
+            if (!(*pte & PTE_PRESENT)) continue;
+            if (free_frames) tlb_defer_free(tlb, (void*)(*pte & ~0xFFFu));
+            *pte = 0;
+            tlb_add(tlb, va);
+        }
+
+        // Reclaim the table once nothing in it is mapped any more. Kernel VA
+        // tables are shared by every address space and stay allocated.
+        if (pdi < vaddr_pdi(KERNEL_VA_BASE) && pt_is_empty(pt)) {
+            *(uint32_t*)&pd[pdi] = 0;
+            // invlpg of an address in the table's range also drops the
+            // cached PDE; past TLB_GATHER_MAX this becomes a CR3 reload
+            tlb_add(tlb, pdi << 22);
+            tlb_defer_free(tlb, pt);
+        }
+    }
+    return ret;
+}
+
+int protect_range(struct tlb_gather *tlb, uint32_t va, uint32_t npages, unsigned int flags) {
+    struct page_directory_entry *pd = tlb->pd;
+    int ret = 0;
+    va = align_down(va, PAGE_SIZE);
+
+    for (uint32_t i = 0; i < npages; ++i, va += PAGE_SIZE) {
+        uint32_t pdi = vaddr_pdi(va);
+        if (!pd[pdi].present) continue;
+        // Opening a kernel table to ring 3 would expose every page in it
+        if ((flags & PTE_USER) && !pd[pdi].user) { ret = -2; continue; }
+        int err;
+        struct page *pt = lookup_pt(pd, pdi, &err);
+        if (!pt) {
+            if (err) ret = -1;   // couldn't split the 4 MiB page: left as is
+            continue;
+        }
+
+        uint32_t *pte = (uint32_t*)pt + vaddr_pti(va);
+        if (!(*pte & PTE_PRESENT)) continue;
+        uint32_t updated = (*pte & ~0xFFFu) | (flags & 0xFFFu) | PTE_PRESENT;
+        if (updated != *pte) {
+            *pte = updated;
+            tlb_add(tlb, va);
+        }
+    }
+    return ret;
+}
+
+void tlb_finish(struct tlb_gather *tlb) {
+    // Kernel mappings (kernel_pd's tables, and those from KERNEL_VA_BASE up)
+    // are shared, so they can be cached whichever directory is loaded. User
+    // pages of a directory that isn't loaded get a clean TLB when its CR3
+    // is loaded. A full flush no longer knows which addresses it covered, so
+    // it always reloads.
+    int shared = (read_cr3() & ~0xFFFu) == (uint32_t)(uintptr_t)tlb->pd || tlb->pd == kernel_pd;
+    if (tlb->full_flush) {
+        __asm__ __volatile__("mov %%cr3, %%eax\n"
+                             "mov %%eax, %%cr3\n" ::: "eax", "memory");
+    } else {
+        for (uint32_t i = 0; i < tlb->nr; ++i)
+            if (shared || tlb->va[i] >= KERNEL_VA_BASE)
+                invlpg((void*)tlb->va[i]);
+    }
+
+    // Safe to reuse unmapped frames and emptied page tables now. Frames still
+    // shared with another address space just lose a reference.
+    while (tlb->free_frames) {
+        void *frame = tlb->free_frames;
+        tlb->free_frames = *(void **)frame;
+        pfa_frame_put(frame);
+    }
+
+    tlb->nr = 0;
+    tlb->full_flush = 0;
+}
+
+/* ===== Copy-on-write address spaces ===== */
+
+static void copy_page(void *dst, const void *src) {
+    uint32_t *d = (uint32_t*)dst;
+    const uint32_t *q = (const uint32_t*)src;
+    for (uint32_t n = PAGE_SIZE / sizeof(uint32_t); n; --n) *d++ = *q++;
+}
+
+struct page_directory_entry *clone_address_space(struct page_directory_entry *src) {
+    struct page_directory_entry *pd = (struct page_directory_entry*)alloc_pt();
+    if (!pd) return 0;
+
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, src);
+
+    for (uint32_t pdi = 0; pdi < PD_ENTRIES - 1; ++pdi) {
+        if (!src[pdi].present) continue;
+
+        // Kernel mappings are shared as-is: same 4 MiB page or page table.
+        // Tables below KERNEL_VA_BASE can be freed once they empty, so each
+        // directory holds a reference on them.
+        if (!src[pdi].user) {
+            pd[pdi] = src[pdi];
+            if (!src[pdi].pagesize && pdi < vaddr_pdi(KERNEL_VA_BASE))
+                pfa_frame_get((void*)(src[pdi].frame << 12));
+            continue;
+        }
+
+        // User page table: copy it, sharing every frame read-only. A user
+        // 4 MiB page is split first so its frames can be shared one by one.
+        uint32_t *spt = src[pdi].pagesize ? (uint32_t*)split_large_pde(src, pdi)
+                                          : (uint32_t*)(src[pdi].frame << 12);
+        uint32_t *dpt = spt ? (uint32_t*)alloc_pt() : 0;
+        if (!dpt) {
+            tlb_finish(&tlb);
+            destroy_address_space(pd);
+            return 0;
+        }
+        for (uint32_t pti = 0; pti < PT_ENTRIES; ++pti) {
+            uint32_t pte = spt[pti];
+            if (!(pte & PTE_PRESENT)) continue;
+            if (pte & PTE_RW) {
+                pte = (pte & ~PTE_RW) | PTE_COW;
+                spt[pti] = pte;
+                tlb_add(&tlb, (pdi << 22) | (pti << 12));
+            }
+            pfa_frame_get((void*)(pte & ~0xFFFu));
+            dpt[pti] = pte;
+        }
+        pd[pdi] = src[pdi];
+        pd[pdi].frame = ((uint32_t)(uintptr_t)dpt) >> 12;
+    }
+
+    // Recursive slot points at the new directory itself
+    paging_init_recursive(pd);
+    tlb_finish(&tlb);   // parent's pages just became read-only
+    return pd;
+}
+
+void destroy_address_space(struct page_directory_entry *pd) {
+    for (uint32_t pdi = 0; pdi < PD_ENTRIES - 1; ++pdi) {
+        if (!pd[pdi].present || pd[pdi].pagesize) continue;
+        // Kernel tables from KERNEL_VA_BASE up belong to kernel_pd
+        if (!pd[pdi].user && pdi >= vaddr_pdi(KERNEL_VA_BASE)) continue;
+
+        uint32_t *pt = (uint32_t*)(pd[pdi].frame << 12);
+        // A table another directory still uses just loses our reference
+        if (!pd[pdi].user || pfa_frame_shared(pt)) {
+            free_pt((struct page*)pt);
+            continue;
+        }
+        for (uint32_t pti = 0; pti < PT_ENTRIES; ++pti)
+            if (pt[pti] & PTE_PRESENT)
+                pfa_frame_put((void*)(pt[pti] & ~0xFFFu));
+        free_pt((struct page*)pt);
+    }
+    free_pt((struct page*)pd);
+}
+
+int cow_handle_fault(uint32_t addr) {
+    struct page_directory_entry *pd = (struct page_directory_entry*)(read_cr3() & ~0xFFFu);
+    uint32_t pdi = vaddr_pdi(addr);
+    if (!pd[pdi].present || pd[pdi].pagesize) return -1;
+
+    uint32_t *pte = (uint32_t*)(pd[pdi].frame << 12) + vaddr_pti(addr);
+    if ((*pte & (PTE_PRESENT | PTE_COW)) != (PTE_PRESENT | PTE_COW)) return -1;
+
+    void *frame = (void*)(*pte & ~0xFFFu);
+    uint32_t flags = (*pte & 0xFFFu & ~PTE_COW) | PTE_RW;
+
+    if (pfa_frame_shared(frame)) {
+        // Still shared: give this address space its own copy
+        void *copy = pfa_alloc_frames(0);
+        if (!copy) return -2;
+        copy_page(copy, frame);
+        pfa_frame_put(frame);
+        frame = copy;
+    }
+    // Sole owner now (or always was): just make it writable again
+    *pte = (uint32_t)(uintptr_t)frame | flags;
+    invlpg((void*)align_down(addr, PAGE_SIZE));
+    return 0;
+}
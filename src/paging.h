@@ -13,7 +13,7 @@ struct page_directory_entry
    uint32_t writethru     : 1;   // Cache this directory as write-thru only
    uint32_t cachedisabled : 1;   // Disable cache on this page table?
    uint32_t accessed      : 1;   // Accessed
-   uint32_t pagesize      : 1;   // 0 => 4 KiB pages
+   uint32_t pagesize      : 1;   // 0 => 4 KiB pages, 1 => 4 MiB page (CR4.PSE)
    uint32_t ignored       : 2;
    uint32_t os_specific   : 3;
    uint32_t frame         : 20;  // physical address >> 12 of the page table
@@ -34,6 +34,19 @@ struct page
 #define PAGE_SIZE    4096u
 #define PD_ENTRIES   1024u
 #define PT_ENTRIES   1024u
+#define LARGE_PAGE_SIZE 0x400000u   /* 4 MiB PSE page */
+
+/* Page tables from here up hold kernel mappings (vmalloc and friends). They
+   are shared by every address space and never freed once allocated. */
+#define KERNEL_VA_BASE 0xC0000000u
+
+/* Low 12 bits of a PTE, as taken by map_page()/map_range() */
+#define PTE_PRESENT  0x001u
+#define PTE_RW       0x002u
+#define PTE_USER     0x004u
+#define PTE_PWT      0x008u   /* write-through */
+#define PTE_PCD      0x010u   /* cache disabled */
+#define PTE_COW      0x200u   /* OS-available bit: read-only because shared copy-on-write */
 
 /* If your frame allocator returns >4KiB blocks (e.g., 2MiB), define PFA_PAGE_BYTES in page.h.
    Otherwise we default to 4 KiB. */
@@ -44,18 +57,23 @@ struct page
 /* ===== Global, 4096-byte aligned paging structures ===== */
 extern struct page_directory_entry kernel_pd[PD_ENTRIES] __attribute__((aligned(4096)));
 
-/* Small static pool of page tables for on-demand creation (each 4 KiB aligned) */
-#ifndef PT_POOL_COUNT
-#define PT_POOL_COUNT 64
-#endif
-extern struct page kernel_pt_pool[PT_POOL_COUNT][PT_ENTRIES] __attribute__((aligned(4096)));
-
 /* ===== Assignment API ===== */
 
-/* Map a linked list of physical pages (pglist) starting at vaddr.
-   Returns the (page-aligned) virtual address mapped. */
+/* Map a linked list of physical blocks (pglist) starting at vaddr.
+   Page tables are allocated from the frame allocator as needed.
+   Returns the (page-aligned) virtual address mapped, or NULL if a page table
+   couldn't be allocated (pages mapped before the failure stay mapped). */
 void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd);
 
+/* Detect PSE with CPUID and set CR4.PSE. Returns nonzero if 4 MiB pages are
+   available; call before map_physical_range() so it can use them. */
+int paging_enable_pse(void);
+
+/* Map [pa, pa + bytes) at va (kernel, R/W). Uses a 4 MiB PDE wherever va and pa
+   are both 4 MiB aligned and a whole 4 MiB remains (if PSE is on), and 4 KiB
+   pages elsewhere. Returns 0 on success, -1 if out of memory for page tables. */
+int map_physical_range(struct page_directory_entry *pd, uint32_t va, uint32_t pa, uint32_t bytes);
+
 /* Load CR3 (PD base, must be physical & 4KiB aligned) */
 void loadPageDirectory(struct page_directory_entry *pd);
 
@@ -70,12 +88,87 @@ void paging_init_recursive(struct page_directory_entry *pd);
 /* ===== Convenience functions that rely on recursive mapping =====
    These match the style you asked for. They require paging enabled and PDE[1023] set. */
 
-/* Translate a virtual address to a physical address; returns NULL if not present. */
+/* Translate a virtual address to a physical address; returns NULL if not present.
+   Understands 4 MiB PDEs. */
 void *get_physaddr(void *virtualaddr);
 
 /* Map a single 4KiB page: physaddr -> virtualaddr with low 12-bit flags (e.g., 0x003 for R/W|Present).
-   Allocates a page table from the static pool if the PDE is not present.
+   Allocates a page table from the frame allocator if the PDE is not present, and
+   splits a 4 MiB PDE into a page table if the address falls inside one.
    Returns 0 on success, negative on error. */
 int map_page(void *physaddr, void *virtualaddr, unsigned int flags);
 
+/* Unmap a single 4KiB page. A page table below KERNEL_VA_BASE left with no
+   present entries has its PDE cleared and is released (see
+   clone_address_space()); kernel VA tables are shared and never freed.
+   Returns 0 on success, negative on error (-3 if nothing was mapped). */
+int unmap_page(void *virtualaddr);
+
+/* ===== Batched mapping with deferred TLB invalidation =====
+   Collect a batch of PTE changes and flush the TLB once, in tlb_finish():
+   per-page invlpg for up to TLB_GATHER_MAX pages, a single CR3 reload past
+   that. Frames released by unmap_range() (and page tables it empties) are
+   only freed after the flush. Usage:
+
+       struct tlb_gather tlb;
+       tlb_gather_init(&tlb, kernel_pd);
+       unmap_range(&tlb, va, npages, 1);
+       map_range(&tlb, va2, pa, npages, PTE_RW);
+       tlb_finish(&tlb);
+*/
+#define TLB_GATHER_MAX 32
+
+struct tlb_gather {
+   struct page_directory_entry *pd;
+   uint32_t nr;                     /* VAs collected in va[] */
+   uint32_t va[TLB_GATHER_MAX];
+   int      full_flush;             /* too many VAs: reload CR3 instead */
+   void    *free_frames;            /* frames to free after the flush */
+};
+
+void tlb_gather_init(struct tlb_gather *tlb, struct page_directory_entry *pd);
+
+/* Map npages 4KiB pages va -> pa with low 12-bit PTE flags.
+   Returns 0 on success, -1 if out of memory for page tables. */
+int map_range(struct tlb_gather *tlb, uint32_t va, uint32_t pa, uint32_t npages, unsigned int flags);
+
+/* Unmap npages pages starting at va. If free_frames is set, the mapped frames
+   are returned to the frame allocator (after the flush). Returns 0, or -1 if
+   a 4 MiB page couldn't be split for a partial unmap (that part stays
+   mapped; the rest of the range is still unmapped). */
+int unmap_range(struct tlb_gather *tlb, uint32_t va, uint32_t npages, int free_frames);
+
+/* Replace the low 12-bit flags of the present pages in the range. Returns 0,
+   -1 if a 4 MiB page couldn't be split (as for unmap_range()), or -2 if
+   flags has PTE_USER for pages whose PDE isn't user-accessible. Those pages
+   keep their flags; the rest of the range is still updated. */
+int protect_range(struct tlb_gather *tlb, uint32_t va, uint32_t npages, unsigned int flags);
+
+/* Flush the collected TLB entries and free deferred frames. The batch can be
+   reused afterwards. Only user addresses of a directory other than the
+   loaded one (and kernel_pd) are skipped: kernel mappings are shared. */
+void tlb_finish(struct tlb_gather *tlb);
+
+/* ===== Copy-on-write address spaces =====
+   clone_address_space() makes a new page directory that shares the kernel
+   page tables and every user frame of src. Writable user pages become
+   read-only + PTE_COW in both directories, and each shared frame gets an
+   extra reference. The first write from either side faults, and
+   cow_handle_fault() copies the page (or, for the last sharer, just makes
+   it writable again). Cost is O(page tables), not O(resident memory).
+   User 4 MiB pages are split in src first. Kernel tables below
+   KERNEL_VA_BASE are reference counted like frames, so neither side frees
+   one the other still uses; those from KERNEL_VA_BASE up are never freed.
+   Kernel page tables added to src later are not propagated. */
+struct page_directory_entry *clone_address_space(struct page_directory_entry *src);
+
+/* Free a directory made by clone_address_space(): drops a reference on every
+   user frame and on every page table below KERNEL_VA_BASE, freeing those
+   nobody else holds. Must not be the loaded CR3. */
+void destroy_address_space(struct page_directory_entry *pd);
+
+/* Resolve a write fault on a present page in the current address space.
+   Returns 0 if it was a COW page and is now writable, negative otherwise. */
+int cow_handle_fault(uint32_t addr);
+
 #endif /* PAGING_H */
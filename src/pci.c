@@ -0,0 +1,84 @@
+#include "pci.h"
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+static inline void outl(uint16_t port, uint32_t v) {
+    __asm__ __volatile__("outl %0, %1" :: "a"(v), "dN"(port));
+}
+
+static inline void outw(uint16_t port, uint16_t v) {
+    __asm__ __volatile__("outw %0, %1" :: "a"(v), "dN"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t v;
+    __asm__ __volatile__("inl %1, %0" : "=a"(v) : "dN"(port));
+    return v;
+}
+
+static uint32_t address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t off) {
+    return 0x80000000u | (uint32_t)bus << 16 | (uint32_t)slot << 11 | (uint32_t)func << 8 | (off & 0xFC);
+}
+
+static uint32_t read32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t off) {
+    outl(PCI_CONFIG_ADDRESS, address(bus, slot, func, off));
+    return inl(PCI_CONFIG_DATA);
+}
+
+uint32_t pci_read32(const struct pci_dev *d, uint8_t off) {
+    return read32(d->bus, d->slot, d->func, off);
+}
+
+void pci_write32(const struct pci_dev *d, uint8_t off, uint32_t v) {
+    outl(PCI_CONFIG_ADDRESS, address(d->bus, d->slot, d->func, off));
+    outl(PCI_CONFIG_DATA, v);
+}
+
+uint16_t pci_read16(const struct pci_dev *d, uint8_t off) {
+    return pci_read32(d, off) >> ((off & 2) * 8);
+}
+
+// A real 16-bit access: a read-modify-write of the dword would write the
+// other half back too, and STATUS bits there are cleared by writing 1
+void pci_write16(const struct pci_dev *d, uint8_t off, uint16_t v) {
+    outl(PCI_CONFIG_ADDRESS, address(d->bus, d->slot, d->func, off));
+    outw(PCI_CONFIG_DATA + (off & 2), v);
+}
+
+int pci_find_class(uint8_t class, uint8_t subclass, struct pci_dev *out) {
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint8_t slot = 0; slot < 32; slot++) {
+            uint8_t nfunc = 1;
+            for (uint8_t func = 0; func < nfunc; func++) {
+                uint32_t id = read32(bus, slot, func, PCI_VENDOR_ID);
+                if ((id & 0xFFFF) == 0xFFFF)
+                    continue;
+                if (func == 0 && (read32(bus, slot, 0, PCI_HEADER_TYPE & 0xFC) >> 16) & 0x80)
+                    nfunc = 8;   // multi-function device
+                uint32_t cls = read32(bus, slot, func, PCI_CLASS_REV);
+                if ((cls >> 24) != class || ((cls >> 16) & 0xFF) != subclass)
+                    continue;
+                out->bus = bus;
+                out->slot = slot;
+                out->func = func;
+                out->vendor = id & 0xFFFF;
+                out->device = id >> 16;
+                out->class = class;
+                out->subclass = subclass;
+                out->prog_if = (cls >> 8) & 0xFF;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+uint32_t pci_bar(const struct pci_dev *d, int n) {
+    uint32_t bar = pci_read32(d, PCI_BAR0 + 4 * n);
+    return bar & 1 ? bar & ~0x3u : bar & ~0xFu;   // I/O or memory
+}
+
+void pci_enable(const struct pci_dev *d, uint16_t bits) {
+    pci_write16(d, PCI_COMMAND, pci_read16(d, PCI_COMMAND) | bits);
+}
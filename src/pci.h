@@ -0,0 +1,42 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+
+/* ===== PCI configuration space (mechanism #1, ports 0xCF8/0xCFC) ===== */
+
+#define PCI_VENDOR_ID   0x00
+#define PCI_COMMAND     0x04
+#define PCI_CLASS_REV   0x08    /* class, subclass, prog-if, revision */
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0        0x10
+
+#define PCI_COMMAND_IO     0x1
+#define PCI_COMMAND_MEMORY 0x2
+#define PCI_COMMAND_MASTER 0x4
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE  0x01
+
+struct pci_dev {
+    uint8_t bus, slot, func;
+    uint16_t vendor, device;
+    uint8_t class, subclass, prog_if;
+};
+
+uint32_t pci_read32(const struct pci_dev *d, uint8_t off);
+void pci_write32(const struct pci_dev *d, uint8_t off, uint32_t v);
+uint16_t pci_read16(const struct pci_dev *d, uint8_t off);
+void pci_write16(const struct pci_dev *d, uint8_t off, uint16_t v);
+
+// Scans every bus for the first function of the given class/subclass.
+// Returns 0 and fills *out if found.
+int pci_find_class(uint8_t class, uint8_t subclass, struct pci_dev *out);
+
+// Base address register n with the type bits masked off
+uint32_t pci_bar(const struct pci_dev *d, int n);
+
+// Sets bits in the command register (e.g. PCI_COMMAND_MASTER)
+void pci_enable(const struct pci_dev *d, uint16_t bits);
+
+#endif // PCI_H
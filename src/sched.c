@@ -0,0 +1,337 @@
+#include "sched.h"
+#include "interrupt.h"
+#include "clockevent.h"
+#include "tasklet.h"
+#include "timer.h"
+#include "rprintf.h"
+#include "kmalloc.h"
+
+extern struct tss_entry tss_ent;
+void switch_to(uint32_t *prev_esp, uint32_t next_esp);
+
+uint32_t context_switches = 0;
+
+static struct thread *current = 0;
+static struct thread *idle = 0;
+static struct thread *all_threads = 0;
+static struct thread *dead = 0;          // exited, stack not freed yet
+static int need_resched = 0;
+static uint32_t next_tid = 0;
+
+static struct thread boot_thread;
+
+/* ===== Run queue: one FIFO per priority, bitmap of non-empty ones ===== */
+
+static uint32_t rq_bitmap = 0;
+static struct thread *rq_head[SCHED_PRIOS], *rq_tail[SCHED_PRIOS];
+
+static void rq_push(struct thread *t) {
+    t->next = 0;
+    if (rq_tail[t->prio])
+        rq_tail[t->prio]->next = t;
+    else
+        rq_head[t->prio] = t;
+    rq_tail[t->prio] = t;
+    rq_bitmap |= 1u << t->prio;
+}
+
+static struct thread *rq_pop(void) {
+    if (!rq_bitmap)
+        return 0;
+    int prio = __builtin_ctz(rq_bitmap);   // bsf: highest priority first
+    struct thread *t = rq_head[prio];
+    rq_head[prio] = t->next;
+    if (!rq_head[prio]) {
+        rq_tail[prio] = 0;
+        rq_bitmap &= ~(1u << prio);
+    }
+    t->next = 0;
+    return t;
+}
+
+/* ===== Switching ===== */
+
+// Frees the stack of a thread that exited (it can't free its own)
+static void reap(void) {
+    if (dead) {
+        kfree(dead->stack);
+        dead->stack = 0;
+        dead = 0;
+    }
+}
+
+static void make_ready(struct thread *t) {
+    t->state = THREAD_READY;
+    rq_push(t);
+    if (current && t->prio < current->prio)
+        need_resched = 1;
+}
+
+void schedule(void) {
+    struct thread *prev = current;
+    need_resched = 0;
+    if (prev->state == THREAD_RUNNING && prev != idle)
+        make_ready(prev);
+    struct thread *next = rq_pop();
+    if (!next)
+        next = idle;
+    if (next == prev) {
+        prev->state = THREAD_RUNNING;
+        prev->slice = SCHED_SLICE;
+        return;
+    }
+
+    next->state = THREAD_RUNNING;
+    next->slice = SCHED_SLICE;
+    next->switches++;
+    context_switches++;
+    prev->esp0 = tss_ent.esp0;    // enter_user() may have moved it
+    tss_ent.esp0 = next->esp0;
+    fpu_switch(&next->fpu);
+    current = next;
+    switch_to(&prev->esp, next->esp);
+    reap();                       // back in prev, on its own stack
+}
+
+static int can_preempt(void) {
+    return current && current != idle && !tasklet_running();
+}
+
+void sched_tick(void) {
+    if (!current)
+        return;
+    if (current == idle) {
+        if (rq_bitmap)
+            need_resched = 1;
+    } else if (current->slice && --current->slice == 0) {
+        // Round robin only among threads of the same or higher priority
+        if (rq_bitmap & ((2u << current->prio) - 1))
+            need_resched = 1;
+        else
+            current->slice = SCHED_SLICE;
+    }
+}
+
+void sched_irq_exit(void) {
+    if (need_resched && can_preempt())
+        schedule();
+}
+
+// After a wakeup with the caller's interrupt flags: switch now if that
+// made a higher-priority thread ready and the caller may be preempted
+static void wakeup_preempt(uint32_t flags) {
+    if ((flags & 0x200) && need_resched && can_preempt())
+        schedule();
+}
+
+/* ===== Threads ===== */
+
+static void thread_start(void) {
+    // First run: arrived here from schedule() with interrupts off
+    reap();
+    __asm__ __volatile__("sti" ::: "memory");
+    current->fn(current->arg);
+    thread_exit();
+}
+
+static void thread_link(struct thread *t, const char *name, int prio) {
+    t->name = name;
+    t->tid = next_tid++;
+    t->prio = prio;
+    t->all_next = all_threads;
+    all_threads = t;
+}
+
+static void idle_fn(void *unused) {
+    __asm__ __volatile__("cli" ::: "memory");
+    while (1) {
+        if (!rq_bitmap)
+            cpu_idle();   // runs tasklets, or sleeps until an interrupt
+        if (rq_bitmap)
+            schedule();
+    }
+}
+
+static struct thread *thread_alloc(const char *name, void (*fn)(void *), void *arg, int prio) {
+    struct thread *t = kmalloc(sizeof(*t));
+    if (!t)
+        return 0;
+    uint8_t *stack = kmalloc(THREAD_STACK_SIZE);
+    if (!stack) {
+        kfree(t);
+        return 0;
+    }
+    for (uint32_t i = 0; i < sizeof(*t); i++)
+        ((uint8_t *)t)[i] = 0;
+    t->stack = stack;
+    t->fn = fn;
+    t->arg = arg;
+    t->esp0 = (uint32_t)(stack + THREAD_STACK_SIZE);
+
+    // A switch_to() frame: edi, esi, ebx, ebp, then the return address
+    uint32_t *sp = (uint32_t *)t->esp0;
+    *--sp = (uint32_t)thread_start;
+    for (int i = 0; i < 4; i++)
+        *--sp = 0;
+    t->esp = (uint32_t)sp;
+
+    uint32_t flags = irq_save();
+    thread_link(t, name, prio);
+    irq_restore(flags);
+    return t;
+}
+
+struct thread *thread_create(const char *name, void (*fn)(void *), void *arg, int prio) {
+    if (prio < 0 || prio >= PRIO_IDLE)
+        return 0;
+    struct thread *t = thread_alloc(name, fn, arg, prio);
+    if (!t)
+        return 0;
+    uint32_t flags = irq_save();
+    make_ready(t);
+    wakeup_preempt(flags);
+    irq_restore(flags);
+    return t;
+}
+
+void sched_init(void) {
+    if (current)
+        return;
+    uint32_t flags = irq_save();
+    boot_thread.state = THREAD_RUNNING;
+    boot_thread.slice = SCHED_SLICE;
+    boot_thread.esp0 = tss_ent.esp0;
+    thread_link(&boot_thread, "main", PRIO_DEFAULT);
+    current = &boot_thread;
+    fpu_switch(&boot_thread.fpu);
+    irq_restore(flags);
+
+    // Never in the run queue: picked only when nothing else is ready
+    idle = thread_alloc("idle", idle_fn, 0, PRIO_IDLE);
+    if (idle)
+        idle->state = THREAD_READY;
+}
+
+void thread_exit(void) {
+    __asm__ __volatile__("cli" ::: "memory");
+    struct thread *t = current;
+    fpu_release(&t->fpu);
+    t->state = THREAD_DEAD;
+    wake_up(&t->exit_wq);
+    if (t->stack)
+        dead = t;   // freed by whoever runs next
+    schedule();
+    while (1);      // not reached
+}
+
+void thread_join(struct thread *t) {
+    uint32_t flags = irq_save();
+    while (t->state != THREAD_DEAD)
+        wait_on(&t->exit_wq);
+    reap();
+    for (struct thread **pp = &all_threads; *pp; pp = &(*pp)->all_next) {
+        if (*pp == t) {
+            *pp = t->all_next;
+            break;
+        }
+    }
+    irq_restore(flags);
+    kfree(t);
+}
+
+void thread_yield(void) {
+    uint32_t flags = irq_save();
+    schedule();
+    irq_restore(flags);
+}
+
+void thread_sleep(uint32_t ticks) {
+    struct wait_queue wq = { 0 };
+    uint32_t flags = irq_save();
+    wait_on_timeout(&wq, ticks);
+    irq_restore(flags);
+}
+
+struct thread *thread_current(void) {
+    return current;
+}
+
+int sched_can_block(void) {
+    return can_preempt();
+}
+
+/* ===== Wait queues ===== */
+
+static void wq_remove(struct wait_queue *wq, struct thread *t) {
+    for (struct thread **pp = &wq->head; *pp; pp = &(*pp)->next) {
+        if (*pp == t) {
+            *pp = t->next;
+            t->next = 0;
+            return;
+        }
+    }
+}
+
+static void wait_timeout(void *arg) {
+    struct thread *t = arg;
+    uint32_t flags = irq_save();
+    if (t->state == THREAD_BLOCKED) {
+        wq_remove(t->wq, t);
+        t->wq = 0;
+        make_ready(t);
+    }
+    irq_restore(flags);   // tasklet context: the switch waits for an IRQ exit
+}
+
+int wait_on_timeout(struct wait_queue *wq, uint32_t ticks) {
+    struct thread *t = current;
+    t->state = THREAD_BLOCKED;
+    t->wq = wq;
+    t->woken = 0;
+    t->next = 0;
+    struct thread **pp = &wq->head;
+    while (*pp)
+        pp = &(*pp)->next;
+    *pp = t;
+
+    struct timer tm;
+    if (ticks) {
+        timer_setup(&tm, wait_timeout, t);
+        timer_add(&tm, jiffies + ticks);
+    }
+    schedule();
+    if (ticks)
+        timer_cancel(&tm);
+    return t->woken;
+}
+
+void wait_on(struct wait_queue *wq) {
+    wait_on_timeout(wq, 0);
+}
+
+void wake_up(struct wait_queue *wq) {
+    uint32_t flags = irq_save();
+    struct thread *t = wq->head;
+    wq->head = 0;
+    while (t) {
+        struct thread *next = t->next;
+        t->wq = 0;
+        t->woken = 1;
+        make_ready(t);
+        t = next;
+    }
+    wakeup_preempt(flags);
+    irq_restore(flags);
+}
+
+/* ===== Introspection ===== */
+
+void sched_dump(int (*pc)(int)) {
+    static const char *const states[] = { "running", "ready", "blocked", "dead" };
+    esp_printf(pc, "tid  %-10s prio %-8s switches\n", "name", "state");
+    uint32_t flags = irq_save();
+    for (struct thread *t = all_threads; t; t = t->all_next)
+        esp_printf(pc, "%3d  %-10s %4d %-8s %d\n", t->tid, t->name, t->prio, states[t->state], t->switches);
+    irq_restore(flags);
+    esp_printf(pc, "context switches: %d\n", context_switches);
+}
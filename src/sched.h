@@ -0,0 +1,113 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include "fpu.h"
+
+/* ===== Kernel threads =====
+   Each thread has its own kernel stack and is switched by switch_to()
+   (switch.S), which saves only the callee-saved registers. Everything
+   else is already on the stack of whoever called schedule().
+
+   Ready threads sit in one FIFO per priority (0 is the highest). A bitmap
+   has a bit set for every non-empty FIFO, so picking the next thread is a
+   single bit scan, independent of the number of threads. Threads of the
+   same priority share the CPU in SCHED_SLICE-tick slices. A wakeup of a
+   higher-priority thread preempts the current one. Preemption happens on
+   the way out of an interrupt that arrived with interrupts enabled, or
+   right away when the wakeup comes from thread context. Tasklets and the
+   idle thread are never preempted.
+
+   On every switch the TSS esp0 (the stack ring 3 traps land on) and the
+   lazy FPU context follow the thread. */
+
+#define SCHED_PRIOS    32
+#define PRIO_DEFAULT   16
+#define PRIO_IDLE      (SCHED_PRIOS - 1)   // only the idle thread
+#define SCHED_SLICE    10                  // ticks before round robin
+#define THREAD_STACK_SIZE 8192
+
+enum thread_state { THREAD_RUNNING, THREAD_READY, THREAD_BLOCKED, THREAD_DEAD };
+
+struct wait_queue {
+    struct thread *head;          // FIFO
+};
+
+struct thread {
+    uint32_t esp;                 // saved stack pointer (switch.S: offset 0)
+    uint32_t esp0;                // TSS esp0 while this thread runs
+    void *stack;                  // kmalloc'd stack, NULL for the boot thread
+    const char *name;
+    uint32_t tid;
+    int prio;
+    enum thread_state state;
+    uint32_t slice;               // ticks left in the current slice
+    struct thread *next;          // run queue or wait queue link
+    struct wait_queue *wq;        // queue it is blocked on, if any
+    int woken;                    // woken by wake_up() rather than a timeout
+    void (*fn)(void *);
+    void *arg;
+    struct fpu_ctx fpu;
+    uint32_t switches;            // times switched in
+    struct wait_queue exit_wq;    // thread_join() waiters
+    struct thread *all_next;      // every thread, for sched_dump()
+};
+
+// Turns the boot flow into the thread "main" (PRIO_DEFAULT) and creates
+// the idle thread. Call after kmalloc_init() and fpu_init().
+void sched_init(void);
+
+// New ready thread running fn(arg) at prio (0 to PRIO_IDLE - 1); NULL if
+// out of memory
+struct thread *thread_create(const char *name, void (*fn)(void *), void *arg, int prio);
+
+// Ends the calling thread (returning from fn does the same)
+void thread_exit(void) __attribute__((noreturn));
+
+// Waits for t to exit and frees it
+void thread_join(struct thread *t);
+
+// Gives the CPU to another ready thread of the same or higher priority
+void thread_yield(void);
+
+// Blocks the calling thread for at least ticks jiffies
+void thread_sleep(uint32_t ticks);
+
+struct thread *thread_current(void);
+
+// Nonzero if the caller may block: the scheduler runs and the caller is a
+// thread other than idle (not a tasklet, not an interrupt handler)
+int sched_can_block(void);
+
+// Picks the next thread. Interrupts must be off.
+void schedule(void);
+
+/* Wait queues. Check the condition and call wait_on() with interrupts
+   off, so a wakeup can't slip in between; it returns with them off:
+
+       uint32_t flags = irq_save();
+       while (!condition)
+           wait_on(&wq);
+       irq_restore(flags);
+*/
+void wait_on(struct wait_queue *wq);
+
+// Same, giving up after ticks jiffies (0: never). Returns 1 if woken by
+// wake_up(), 0 on timeout.
+int wait_on_timeout(struct wait_queue *wq, uint32_t ticks);
+
+// Makes every thread waiting on wq ready. Safe from interrupt handlers.
+void wake_up(struct wait_queue *wq);
+
+// Timer tick hook (clockevent.c), interrupts off
+void sched_tick(void);
+
+// Interrupt exit hook: switches if a preemption is due. Called with
+// interrupts off when the interrupted code had them on.
+void sched_irq_exit(void);
+
+void sched_dump(int (*pc)(int));
+
+extern uint32_t context_switches;
+
+#endif // SCHED_H
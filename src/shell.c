@@ -0,0 +1,147 @@
+#include <stdint.h>
+#include "shell.h"
+#include "rprintf.h"
+#include "interrupt.h"
+#include "page.h"
+#include "timer.h"
+#include "tsc.h"
+#include "sched.h"
+#include "bcache.h"
+
+#define SHELL_LINE_MAX 80
+
+int putc(int ch);
+
+static char line[SHELL_LINE_MAX + 1];
+static unsigned int line_len = 0;
+
+/* ===== Helpers ===== */
+
+static int streq(const char *a, const char *b) {
+    while (*a && *a == *b) { a++; b++; }
+    return *a == *b;
+}
+
+// Splits the next space-separated word off *s (NUL-terminating it in place)
+static char *next_word(char **s) {
+    char *p = *s;
+    while (*p == ' ') p++;
+    if (!*p) return 0;
+    char *w = p;
+    while (*p && *p != ' ') p++;
+    if (*p) *p++ = 0;
+    *s = p;
+    return w;
+}
+
+// Decimal or 0x-prefixed hex. Returns -1 if w isn't a number.
+static int parse_number(const char *w) {
+    int base = 10, v = 0;
+    if (w[0] == '0' && w[1] == 'x') { base = 16; w += 2; }
+    if (!*w) return -1;
+    for (; *w; w++) {
+        int d;
+        if (*w >= '0' && *w <= '9') d = *w - '0';
+        else if (base == 16 && *w >= 'a' && *w <= 'f') d = *w - 'a' + 10;
+        else return -1;
+        v = v * base + d;
+    }
+    return v;
+}
+
+/* ===== Commands ===== */
+
+static void cmd_help(char *args) {
+    esp_printf(putc, "help | irqstat [vector|reset] | timing | mem | uptime | ps | sync | bcache\n");
+}
+
+static void cmd_irqstat(char *args) {
+    char *w = next_word(&args);
+    if (!w) {
+        interrupt_stats_dump(putc);
+    } else if (streq(w, "reset")) {
+        interrupt_stats_reset();
+    } else {
+        int v = parse_number(w);
+        if (v < 0 || v >= IDT_SIZE)
+            esp_printf(putc, "irqstat: bad vector '%s'\n", w);
+        else
+            interrupt_stats_dump_vector(putc, v);
+    }
+}
+
+static void cmd_timing(char *args) {
+    timing_dump(putc);
+}
+
+static void cmd_mem(char *args) {
+    esp_printf(putc, "%d of %d frames free\n", pfa_free_count(), pfa_total_count());
+}
+
+static void cmd_uptime(char *args) {
+    uint32_t ms = (uint32_t)div64_32(ktime_ns(), 1000000u, 0);
+    esp_printf(putc, "jiffies=%d  ktime=%d ms\n", jiffies, ms);
+}
+
+static void cmd_ps(char *args) {
+    sched_dump(putc);
+}
+
+// Runs in a tasklet, which can't sleep: the flusher thread does the work
+static void cmd_sync(char *args) {
+    esp_printf(putc, "%d dirty sectors, writing back\n", bcache_dirty_count());
+    bcache_kick();
+}
+
+static void cmd_bcache(char *args) {
+    bcache_dump(putc);
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(char *args);
+} commands[] = {
+    { "help",    cmd_help },
+    { "irqstat", cmd_irqstat },
+    { "timing",  cmd_timing },
+    { "mem",     cmd_mem },
+    { "uptime",  cmd_uptime },
+    { "ps",      cmd_ps },
+    { "sync",    cmd_sync },
+    { "bcache",  cmd_bcache },
+};
+
+static void run_line(char *s) {
+    char *name = next_word(&s);
+    if (!name)
+        return;
+    for (unsigned int i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (streq(name, commands[i].name)) {
+            commands[i].fn(s);
+            return;
+        }
+    }
+    esp_printf(putc, "unknown command '%s' (try help)\n", name);
+}
+
+/* ===== Public API ===== */
+
+void shell_prompt(void) {
+    esp_printf(putc, "> ");
+}
+
+void shell_key(char c) {
+    if (c == '\n') {
+        putc('\n');
+        line[line_len] = 0;
+        run_line(line);
+        line_len = 0;
+        shell_prompt();
+    } else if (c == '\b') {
+        if (line_len)
+            line_len--;   // the VGA console can't erase; just drop it from the line
+    } else if (c >= ' ' && line_len < SHELL_LINE_MAX) {
+        line[line_len++] = c;
+        putc(c);
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef SHELL_H
+#define SHELL_H
+
+/* ===== Console command line =====
+   Collects typed characters into a line and runs it on Enter. Commands:
+     help               list commands
+     irqstat [vector]   per-vector interrupt counts, or one vector's histograms
+     irqstat reset      clear the interrupt statistics
+     timing             TIME_SCOPE call-site statistics
+     mem                free / total page frames
+     uptime             jiffies and ktime_ns() */
+
+// Feed one character from the keyboard
+void shell_key(char c);
+
+// Print the prompt
+void shell_prompt(void);
+
+#endif // SHELL_H
@@ -0,0 +1,119 @@
+#include "syscall.h"
+#include "interrupt.h"
+#include "cpu.h"
+#include "timer.h"
+#include "vm.h"
+#include "paging.h"
+
+int putc(int ch);
+void user_exit(uint32_t code) __attribute__((noreturn));
+
+extern char sysenter_entry[];
+extern char user_bench_start[], user_bench_end[];
+
+static int fast_path = 0;
+
+// Only touched between SYSENTER and the switch to the TSS's esp0 (an NMI
+// in that window would land here)
+static uint32_t sysenter_stack[64];
+
+/* ===== Calls ===== */
+
+// [addr, addr + len) lies in a ring 3 region
+static int user_range_ok(uint32_t addr, uint32_t len) {
+    struct vm_region *r = vm_find(addr);
+    return r && (r->flags & VM_USER) && len <= r->end - addr;
+}
+
+static int32_t sys_null(uint32_t a1, uint32_t a2, uint32_t a3) {
+    return 0;
+}
+
+static int32_t sys_exit(uint32_t code, uint32_t a2, uint32_t a3) {
+    user_exit(code);
+}
+
+static int32_t sys_write(uint32_t buf, uint32_t len, uint32_t a3) {
+    if (!user_range_ok(buf, len))
+        return -EFAULT;
+    const char *s = (const char *)buf;
+    for (uint32_t i = 0; i < len; i++)
+        putc(s[i]);
+    return len;
+}
+
+static int32_t sys_uptime(uint32_t a1, uint32_t a2, uint32_t a3) {
+    return jiffies_to_msecs(jiffies);
+}
+
+syscall_fn_t syscall_table[NR_SYSCALLS] = {
+    [SYS_NULL]   = sys_null,
+    [SYS_EXIT]   = sys_exit,
+    [SYS_WRITE]  = sys_write,
+    [SYS_UPTIME] = sys_uptime,
+};
+
+int32_t syscall_dispatch(uint32_t nr, uint32_t a1, uint32_t a2, uint32_t a3) {
+    if (nr >= NR_SYSCALLS || !syscall_table[nr])
+        return -ENOSYS;
+    return syscall_table[nr](a1, a2, a3);
+}
+
+/* ===== Entry paths ===== */
+
+static void syscall_int80(struct trap_frame *tf) {
+    tf->eax = syscall_dispatch(tf->eax, tf->ebx, tf->esi, tf->edi);
+}
+
+// The Pentium Pro reports SEP without implementing it
+static int has_sysenter(void) {
+    struct cpuid_regs r;
+    if (!cpu_has(CPU_FEATURE_SEP) || !cpuid(1, &r))
+        return 0;
+    uint32_t family = (r.eax >> 8) & 0xF, model = (r.eax >> 4) & 0xF, stepping = r.eax & 0xF;
+    return !(family == 6 && model < 3 && stepping < 3);
+}
+
+void syscall_init(void) {
+    register_interrupt_handler(0x80, syscall_int80);
+    if (!has_sysenter())
+        return;
+    // SYSENTER loads cs from the MSR and ss = cs + 8; SYSEXIT returns to
+    // cs + 16 and ss + 24 (with RPL 3): the GDT's kernel code/data and
+    // user code/data descriptors, in that order
+    wrmsr(MSR_SYSENTER_CS, 0x08);
+    wrmsr(MSR_SYSENTER_ESP, (uint32_t)&sysenter_stack[64]);
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+    fast_path = 1;
+}
+
+int syscall_fast_path(void) {
+    return fast_path;
+}
+
+/* ===== Benchmark ===== */
+
+#define BENCH_VA 0x4C000000u   // one code page and one stack page
+
+int syscall_bench(uint32_t iters, uint64_t *int80, uint64_t *fast) {
+    uint32_t size = user_bench_end - user_bench_start;
+    if (iters == 0 || size > PAGE_SIZE)
+        return -1;
+    struct vm_region *r = vm_reserve(BENCH_VA, 2 * PAGE_SIZE, VM_WRITE | VM_USER);
+    if (!r)
+        return -1;
+
+    char *code = (char *)BENCH_VA;
+    for (uint32_t i = 0; i < size; i++)
+        code[i] = user_bench_start[i];
+    volatile uint32_t *args = (uint32_t *)(BENCH_VA + 2 * PAGE_SIZE - 32);
+    args[0] = iters;
+    args[1] = fast_path;
+    args[2] = args[3] = args[4] = args[5] = 0;
+
+    enter_user(BENCH_VA, (uint32_t)args);
+    *int80 = args[2] | (uint64_t)args[3] << 32;
+    *fast = args[4] | (uint64_t)args[5] << 32;
+    vm_release(r);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+/* ===== System calls =====
+   Ring 3 enters the kernel either with int 0x80 (always available) or, when
+   CPUID reports SEP, with SYSENTER, which skips the IDT gate, the stack
+   switch through the TSS and the full register save. Both paths end up in
+   syscall_dispatch(), which indexes syscall_table.
+
+   ABI (both paths): eax = call number, arguments in ebx, esi, edi, result
+   in eax. ebx, esi, edi and ebp are preserved. For SYSENTER the caller also
+   puts its esp in ecx and the return address in edx; those two are not
+   preserved:
+
+       mov $SYS_NULL, %eax
+       mov %esp, %ecx
+       lea 1f, %edx
+       sysenter
+   1:
+*/
+
+#define SYS_NULL   0    /* does nothing: for measuring entry/exit cost */
+#define SYS_EXIT   1    /* (code): back to enter_user()'s caller */
+#define SYS_WRITE  2    /* (buf, len): print to the console */
+#define SYS_UPTIME 3    /* (): milliseconds since boot */
+#define NR_SYSCALLS 4
+
+#define ENOSYS 38
+#define EFAULT 14
+
+#ifndef __ASSEMBLER__
+#include <stdint.h>
+
+typedef int32_t (*syscall_fn_t)(uint32_t a1, uint32_t a2, uint32_t a3);
+
+extern syscall_fn_t syscall_table[NR_SYSCALLS];
+
+// Hooks int 0x80 and, if the CPU has it, programs the SYSENTER MSRs.
+// Call after init_idt().
+void syscall_init(void);
+
+// Nonzero if SYSENTER/SYSEXIT is set up
+int syscall_fast_path(void);
+
+// Runs call nr; -ENOSYS for an unknown number
+int32_t syscall_dispatch(uint32_t nr, uint32_t a1, uint32_t a2, uint32_t a3);
+
+// Drops to ring 3 at eip with stack esp and returns the code passed to
+// SYS_EXIT. Traps from ring 3 use the kernel stack below this call's frame.
+uint32_t enter_user(uint32_t eip, uint32_t esp);
+
+// Null syscall round trips from ring 3: iters calls through int 0x80 and
+// (if available) through SYSENTER, total TSC cycles of each loop in
+// *int80 and *fast (0 without the fast path). Returns -1 on failure.
+int syscall_bench(uint32_t iters, uint64_t *int80, uint64_t *fast);
+
+#endif // __ASSEMBLER__
+#endif // SYSCALL_H
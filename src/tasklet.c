@@ -0,0 +1,61 @@
+#include "tasklet.h"
+#include "interrupt.h"
+
+// Passes over the queue per run_tasklets() call. Work scheduled by the
+// last pass is left for the next interrupt exit or idle loop, so a
+// tasklet that keeps rescheduling itself can't starve everything else.
+#define TASKLET_MAX_PASSES 4
+
+static struct tasklet *head = 0;
+static struct tasklet **tail = &head;
+static int running = 0;
+
+void tasklet_init(struct tasklet *t, void (*fn)(void *), void *data) {
+    t->fn = fn;
+    t->data = data;
+    t->next = 0;
+    t->pending = 0;
+}
+
+int tasklet_schedule(struct tasklet *t) {
+    uint32_t flags = irq_save();
+    int queued = !t->pending;
+    if (queued) {
+        t->pending = 1;
+        t->next = 0;
+        *tail = t;
+        tail = &t->next;
+    }
+    irq_restore(flags);
+    return queued;
+}
+
+int tasklets_pending(void) {
+    return head != 0;
+}
+
+int tasklet_running(void) {
+    return running;
+}
+
+void run_tasklets(void) {
+    if (running)
+        return;
+    running = 1;
+    for (int pass = 0; pass < TASKLET_MAX_PASSES && head; pass++) {
+        // Take the whole queue; anything scheduled meanwhile goes on a new one
+        struct tasklet *t = head;
+        head = 0;
+        tail = &head;
+
+        __asm__ __volatile__("sti" ::: "memory");
+        while (t) {
+            struct tasklet *next = t->next;
+            t->pending = 0;   // cleared first: the function may reschedule it
+            t->fn(t->data);
+            t = next;
+        }
+        __asm__ __volatile__("cli" ::: "memory");
+    }
+    running = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef TASKLET_H
+#define TASKLET_H
+
+#include <stdint.h>
+
+/* ===== Deferred work (bottom halves) =====
+   An interrupt handler (top half) only acknowledges its device and calls
+   tasklet_schedule(); the tasklet's function runs later with interrupts
+   enabled, either on the way out of the interrupt (if the interrupted code
+   had interrupts on) or from cpu_idle(). Scheduling a tasklet that is
+   already pending is a no-op, so a burst of IRQs costs one run. Tasklets
+   run one at a time, in the order they were scheduled, and never nest. */
+
+struct tasklet {
+    void (*fn)(void *data);
+    void *data;
+    struct tasklet *next;
+    volatile int pending;
+};
+
+void tasklet_init(struct tasklet *t, void (*fn)(void *), void *data);
+
+// Queues t unless it is already pending. Safe from interrupt handlers.
+// Returns 1 if queued, 0 if merged with the pending run.
+int tasklet_schedule(struct tasklet *t);
+
+// Nonzero if any tasklet is queued
+int tasklets_pending(void);
+
+// Nonzero while run_tasklets() is running them
+int tasklet_running(void);
+
+// Runs queued tasklets with interrupts enabled. Call with interrupts
+// disabled; returns with them disabled. Does nothing if already running
+// further up the stack.
+void run_tasklets(void);
+
+#endif // TASKLET_H
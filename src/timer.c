@@ -0,0 +1,171 @@
+#include "timer.h"
+#include "interrupt.h"
+#include "clockevent.h"
+#include "tasklet.h"
+#include "sched.h"
+
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1u << TVR_BITS)
+#define TVN_SIZE (1u << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+
+volatile uint32_t jiffies = 0;
+
+/* Level 0 (tv1) has one slot per tick; level n covers 2^(8 + 6n) ticks.
+   timer_jiffies is the next tick the wheel has yet to process. */
+static struct timer *tv1[TVR_SIZE];
+static struct timer *tvn[4][TVN_SIZE];
+static uint32_t timer_jiffies = 0;
+
+static void run_timers(void *unused);
+static struct tasklet timer_tasklet = { .fn = run_timers };
+
+/* ===== Wheel helpers (interrupts off) ===== */
+
+static void list_add(struct timer **head, struct timer *t) {
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+static void list_del(struct timer *t) {
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = 0;
+    t->pprev = 0;
+}
+
+static void internal_add(struct timer *t) {
+    uint32_t expires = t->expires;
+    uint32_t idx = expires - timer_jiffies;
+
+    if ((int32_t)idx < 0) {
+        // Already due: run on the next tick processed
+        list_add(&tv1[timer_jiffies & TVR_MASK], t);
+    } else if (idx < TVR_SIZE) {
+        list_add(&tv1[expires & TVR_MASK], t);
+    } else {
+        int level = 0;
+        while (level < 3 && idx >= 1u << (TVR_BITS + (level + 1) * TVN_BITS))
+            level++;
+        list_add(&tvn[level][(expires >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK], t);
+    }
+}
+
+// Re-files every timer of one upper-level slot into finer slots.
+// Returns the slot index so the caller knows whether to cascade further.
+static uint32_t cascade(int level) {
+    uint32_t index = (timer_jiffies >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+    struct timer *t = tvn[level][index];
+    tvn[level][index] = 0;
+    while (t) {
+        struct timer *next = t->next;
+        internal_add(t);
+        t = next;
+    }
+    return index;
+}
+
+// Tasklet: catches the wheel up with jiffies. Callbacks run with
+// interrupts enabled; the wheel itself is only touched with them off.
+static void run_timers(void *unused) {
+    uint32_t flags = irq_save();
+    while (time_after_eq(jiffies, timer_jiffies)) {
+        uint32_t index = timer_jiffies & TVR_MASK;
+        if (index == 0) {
+            for (int level = 0; level < 4 && cascade(level) == 0; level++)
+                ;
+        }
+        timer_jiffies++;
+
+        struct timer **slot = &tv1[index];
+        while (*slot) {
+            struct timer *t = *slot;
+            list_del(t);
+            irq_restore(flags);
+            t->fn(t->arg);   // may re-arm t
+            flags = irq_save();
+        }
+    }
+    irq_restore(flags);
+}
+
+/* ===== Public API ===== */
+
+void timer_advance(uint32_t ticks) {
+    jiffies += ticks;
+    tasklet_schedule(&timer_tasklet);
+}
+
+static void slot_min(struct timer *t, uint32_t *best, int *found) {
+    for (; t; t = t->next) {
+        if (!*found || time_before(t->expires, *best)) {
+            *best = t->expires;
+            *found = 1;
+        }
+    }
+}
+
+int timer_next_expiry(uint32_t *when) {
+    int found = 0;
+    // tv1 slots hold exactly one expiry each (or overdue timers), so the
+    // first non-empty one from the current tick on is the earliest there
+    for (uint32_t i = 0; i < TVR_SIZE && !found; i++)
+        slot_min(tv1[(timer_jiffies + i) & TVR_MASK], when, &found);
+    // Upper levels aren't ordered by slot; they're only walked in full
+    for (int level = 0; level < 4; level++)
+        for (uint32_t i = 0; i < TVN_SIZE; i++)
+            slot_min(tvn[level][i], when, &found);
+    return found;
+}
+
+void timer_setup(struct timer *t, void (*fn)(void *), void *arg) {
+    t->fn = fn;
+    t->arg = arg;
+    t->next = 0;
+    t->pprev = 0;
+}
+
+void timer_add(struct timer *t, uint32_t expires) {
+    uint32_t flags = irq_save();
+    if (t->pprev)
+        list_del(t);
+    t->expires = expires;
+    internal_add(t);
+    irq_restore(flags);
+}
+
+int timer_cancel(struct timer *t) {
+    uint32_t flags = irq_save();
+    int was_pending = t->pprev != 0;
+    if (was_pending)
+        list_del(t);
+    irq_restore(flags);
+    return was_pending;
+}
+
+static void wake_flag(void *arg) {
+    *(volatile int *)arg = 1;
+}
+
+void msleep(uint32_t ms) {
+    if (sched_can_block()) {
+        thread_sleep(msecs_to_jiffies(ms) + 1);
+        return;
+    }
+    volatile int done = 0;
+    struct timer t;
+    timer_setup(&t, wake_flag, (void *)&done);
+    // +1: the current tick is already partly over
+    timer_add(&t, jiffies + msecs_to_jiffies(ms) + 1);
+
+    __asm__ __volatile__("cli" ::: "memory");
+    while (!done)
+        cpu_idle();
+    __asm__ __volatile__("sti" ::: "memory");
+}
@@ -0,0 +1,71 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/* ===== System tick and kernel timers =====
+   The tick device (clockevent.h) advances jiffies HZ times a second, or in
+   one step after a tickless idle period, and a tasklet runs expired
+   timers from a hierarchical timer wheel: 256 slots for the next 256
+   ticks, then four levels of 64 slots, each covering 64 times the span of
+   the level below. Timers far out sit in a coarse slot and are cascaded
+   down as their time gets near, so add and cancel are O(1) and a tick only
+   touches one slot (plus an occasional cascade). */
+
+#ifndef CONFIG_HZ
+#define CONFIG_HZ 100
+#endif
+#define HZ CONFIG_HZ
+
+#define PIT_FREQUENCY 1193182u   /* PIT input clock, Hz */
+
+// Ticks since timer_init(). Wraps after 2^32 ticks; compare with time_after().
+extern volatile uint32_t jiffies;
+
+// Wrap-safe comparisons of tick counts
+#define time_after(a, b)     ((int32_t)((b) - (a)) < 0)
+#define time_after_eq(a, b)  ((int32_t)((a) - (b)) >= 0)
+#define time_before(a, b)    time_after(b, a)
+
+// Rounds up, so a timeout never fires early
+static inline uint32_t msecs_to_jiffies(uint32_t ms) {
+    return (ms * HZ + 999u) / 1000u;
+}
+
+static inline uint32_t jiffies_to_msecs(uint32_t j) {
+    return j * (1000u / HZ);
+}
+
+struct timer {
+    uint32_t expires;                 // jiffies value to fire at
+    void (*fn)(void *arg);            // called from a tasklet, interrupts on
+    void *arg;
+    struct timer *next;
+    struct timer **pprev;             // NULL while not pending
+};
+
+// Adds ticks to jiffies and schedules the tasklet that runs due timers.
+// Called by the tick code (clockevent.c) with interrupts off.
+void timer_advance(uint32_t ticks);
+
+// Earliest expiry among pending timers. Returns 0 if none is pending.
+// Interrupts must be off.
+int timer_next_expiry(uint32_t *when);
+
+void timer_setup(struct timer *t, void (*fn)(void *), void *arg);
+
+// Arms t to fire at jiffies value expires (re-arms it if already pending)
+void timer_add(struct timer *t, uint32_t expires);
+
+// Disarms t. Returns nonzero if it was pending.
+int timer_cancel(struct timer *t);
+
+static inline int timer_pending(const struct timer *t) {
+    return t->pprev != 0;
+}
+
+// Waits at least ms milliseconds: blocks the calling thread, or halts the
+// CPU before the scheduler runs (interrupts are left enabled)
+void msleep(uint32_t ms);
+
+#endif // TIMER_H
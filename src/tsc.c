@@ -0,0 +1,130 @@
+#include "tsc.h"
+#include "cpu.h"
+#include "timer.h"
+#include "rprintf.h"
+
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND  0x43
+#define SPEAKER_PORT 0x61            /* bit 0: channel 2 gate, bit 1: speaker, bit 5: OUT2 */
+
+#define CALIBRATE_MS 10u
+
+// Give up waiting for OUT2 after this many cycles: CALIBRATE_MS at 10 GHz,
+// faster than any TSC
+#define CALIBRATE_CYCLES_MAX (CALIBRATE_MS * 10000000ull)
+
+void outb(uint16_t _port, uint8_t val);
+uint8_t inb(uint16_t _port);
+
+uint32_t tsc_khz = 0;
+
+static uint32_t ns_mult, ns_shift;   // ns = (cycles * ns_mult) >> ns_shift
+static uint64_t tsc_base;
+static struct timing_stat *timing_sites = 0;
+
+uint64_t div64_32(uint64_t n, uint32_t d, uint32_t *rem) {
+    uint32_t hi = (uint32_t)(n >> 32), lo = (uint32_t)n;
+    uint32_t q_hi = hi / d, q_lo, r;
+    hi %= d;
+    // hi < d, so the quotient of hi:lo / d fits in 32 bits
+    __asm__("divl %4" : "=a"(q_lo), "=d"(r) : "a"(lo), "d"(hi), "rm"(d));
+    if (rem)
+        *rem = r;
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+// Cycles elapsed over CALIBRATE_MS, timed by PIT channel 2 in one-shot mode.
+// Returns 0 if OUT2 never goes high (no channel 2, or no speaker gate).
+static uint64_t measure_tsc(void) {
+    uint32_t count = PIT_FREQUENCY * CALIBRATE_MS / 1000u;
+    uint8_t gate = inb(SPEAKER_PORT);
+    outb(SPEAKER_PORT, (gate & ~0x02) | 0x01);   // gate on, speaker off
+    outb(PIT_COMMAND, 0xB0);                     // channel 2, lobyte/hibyte, mode 0
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, count >> 8);
+
+    uint64_t start = rdtsc();
+    while (!(inb(SPEAKER_PORT) & 0x20)) {        // OUT2 goes high at terminal count
+        if (rdtsc() - start > CALIBRATE_CYCLES_MAX) {
+            outb(SPEAKER_PORT, gate);
+            return 0;
+        }
+    }
+    uint64_t end = rdtsc();
+    outb(SPEAKER_PORT, gate);
+    return end - start;
+}
+
+void tsc_init(void) {
+    if (!cpu_has(CPU_FEATURE_TSC))
+        return;
+
+    // Best of three: an SMI or host preemption only ever makes a run longer
+    uint64_t best = ~0ull;
+    for (int i = 0; i < 3; i++) {
+        uint64_t c = measure_tsc();
+        if (c == 0)
+            return;     // no PIT gate to time against: stay on jiffies
+        if (c < best)
+            best = c;
+    }
+    uint64_t khz = div64_32(best, CALIBRATE_MS, 0);
+    if (khz == 0 || khz >> 32)
+        return;
+    tsc_khz = (uint32_t)khz;
+
+    // Largest shift whose mult still fits in 32 bits: most precision
+    for (ns_shift = 32; ns_shift > 0; ns_shift--) {
+        uint64_t m = div64_32(1000000ull << ns_shift, tsc_khz, 0);
+        if (!(m >> 32)) {
+            ns_mult = (uint32_t)m;
+            break;
+        }
+    }
+    tsc_base = rdtsc();
+}
+
+uint64_t cycles(void) {
+    return tsc_khz ? rdtsc() : jiffies;
+}
+
+uint64_t cycles_to_ns(uint64_t c) {
+    if (!tsc_khz)
+        return (uint64_t)c * (1000000000u / HZ);
+    // 96-bit product, split so each half fits in 64 bits
+    uint64_t lo = (uint64_t)(uint32_t)c * ns_mult;
+    uint64_t hi = (uint64_t)(uint32_t)(c >> 32) * ns_mult;
+    return (lo >> ns_shift) + (ns_shift ? hi << (32 - ns_shift) : hi << 32);
+}
+
+uint64_t ktime_ns(void) {
+    return cycles_to_ns(cycles() - (tsc_khz ? tsc_base : 0));
+}
+
+/* ===== Scoped timing ===== */
+
+void timing_scope_end(struct timing_scope *scope) {
+    uint64_t d = cycles() - scope->start;
+    struct timing_stat *s = scope->stat;
+    if (s->count++ == 0) {
+        s->next = timing_sites;
+        timing_sites = s;
+    }
+    s->total += d;
+    if (d < s->min) s->min = d;
+    if (d > s->max) s->max = d;
+}
+
+// ns as a 32-bit value for printing; rprintf has no 64-bit conversions
+static uint32_t print_ns(uint64_t c) {
+    uint64_t ns = cycles_to_ns(c);
+    return ns >> 31 ? 0x7FFFFFFFu : (uint32_t)ns;
+}
+
+void timing_dump(int (*pc)(int)) {
+    esp_printf(pc, "%-24s %8s %10s %10s %10s\n", "site", "calls", "min ns", "avg ns", "max ns");
+    for (struct timing_stat *s = timing_sites; s; s = s->next) {
+        esp_printf(pc, "%-24s %8d %10d %10d %10d\n", s->name, s->count, print_ns(s->min),
+                   print_ns(div64_32(s->total, s->count, 0)), print_ns(s->max));
+    }
+}
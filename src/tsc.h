@@ -0,0 +1,73 @@
+#ifndef TSC_H
+#define TSC_H
+
+#include <stdint.h>
+
+/* ===== High-resolution time =====
+   cycles() reads the time stamp counter. tsc_init() measures its rate
+   against a 10 ms gate of PIT channel 2, and ktime_ns() converts cycles to
+   nanoseconds as (cycles * mult) >> shift, so no 64-bit division is needed.
+   Without a TSC, or if channel 2 never reaches its terminal count, both
+   fall back to jiffies (timer tick resolution). */
+
+// Detects RDTSC and calibrates it. Uses PIT channel 2 and the speaker gate
+// (port 0x61) only, so it can run before paging and interrupts.
+void tsc_init(void);
+
+// TSC frequency in kHz (0 if there is no usable TSC)
+extern uint32_t tsc_khz;
+
+static inline uint64_t rdtsc(void) {
+    uint64_t v;
+    __asm__ __volatile__("rdtsc" : "=A"(v));
+    return v;
+}
+
+// Cycle counter (the TSC, or jiffies without one)
+uint64_t cycles(void);
+
+// Nanoseconds since tsc_init()
+uint64_t ktime_ns(void);
+
+// Converts a cycles() difference to nanoseconds
+uint64_t cycles_to_ns(uint64_t c);
+
+// n / d for 64-bit n (the kernel has no libgcc for 64-bit division).
+// Stores the remainder in *rem if rem is not NULL.
+uint64_t div64_32(uint64_t n, uint32_t d, uint32_t *rem);
+
+/* ===== Scoped timing =====
+   TIME_SCOPE("name") at the top of a block times everything from there to
+   the end of the block and accumulates min/avg/max per call site:
+
+       void f(void) {
+           TIME_SCOPE("f");
+           ...
+       }
+
+   timing_dump() prints every call site that has run. */
+struct timing_stat {
+    const char *name;
+    uint32_t count;
+    uint64_t total, min, max;        // cycles
+    struct timing_stat *next;        // registered sites, set on first use
+};
+
+struct timing_scope {
+    struct timing_stat *stat;
+    uint64_t start;
+};
+
+void timing_scope_end(struct timing_scope *scope);
+void timing_dump(int (*pc)(int));
+
+#define TIMING_CONCAT_(a, b) a##b
+#define TIMING_CONCAT(a, b) TIMING_CONCAT_(a, b)
+#define TIME_SCOPE(label)                                                      \
+    static struct timing_stat TIMING_CONCAT(timing_stat_, __LINE__) =          \
+        { .name = (label), .min = ~0ull };                                     \
+    struct timing_scope TIMING_CONCAT(timing_scope_, __LINE__)                 \
+        __attribute__((cleanup(timing_scope_end))) =                           \
+        { &TIMING_CONCAT(timing_stat_, __LINE__), cycles() }
+
+#endif // TSC_H
@@ -0,0 +1,117 @@
+#include "vm.h"
+#include "page.h"
+#include "paging.h"
+#include "kmalloc.h"
+
+// All reserved regions, sorted by start address
+static struct vm_region *regions = NULL;
+
+/* ===== Helpers ===== */
+static inline uint32_t align_down(uint32_t x, uint32_t a) { return x & ~(a - 1u); }
+static inline uint32_t align_up(uint32_t x, uint32_t a) { return (x + a - 1u) & ~(a - 1u); }
+
+static inline struct page_directory_entry *current_pd(void) {
+    uint32_t cr3;
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3));
+    return (struct page_directory_entry *)(cr3 & ~0xFFFu);  // identity-mapped
+}
+
+static void zero_page(void *page) {
+    uint32_t *p = (uint32_t *)page;
+    for (uint32_t n = PAGE_SIZE / sizeof(uint32_t); n; --n) *p++ = 0;
+}
+
+/* ===== Public API ===== */
+
+struct vm_region *vm_find(uint32_t addr) {
+    for (struct vm_region *r = regions; r && r->start <= addr; r = r->next)
+        if (addr < r->end)
+            return r;
+    return NULL;
+}
+
+struct vm_region *vm_reserve(uint32_t start, uint32_t size, unsigned int flags) {
+    uint32_t end = align_up(start + size, PAGE_SIZE);
+    start = align_down(start, PAGE_SIZE);
+    if (size == 0 || end <= start)
+        return NULL;
+
+    // Find the insertion point and refuse overlaps
+    struct vm_region **link = &regions;
+    while (*link && (*link)->end <= start)
+        link = &(*link)->next;
+    if (*link && (*link)->start < end)
+        return NULL;
+
+    struct vm_region *r = kmalloc(sizeof(*r));
+    if (!r)
+        return NULL;
+    r->start = start;
+    r->end = end;
+    r->flags = flags;
+    r->faults = 0;
+    r->resident = 0;
+    r->next = *link;
+    *link = r;
+    return r;
+}
+
+int vm_release(struct vm_region *region) {
+    struct vm_region **link = &regions;
+    while (*link && *link != region)
+        link = &(*link)->next;
+    if (!*link)
+        return -1;
+
+    // Only touched pages are mapped; unmap_range skips the rest cheaply
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, current_pd());
+    int ret = unmap_range(&tlb, region->start, (region->end - region->start) / PAGE_SIZE, 1);
+    tlb_finish(&tlb);
+
+    if (ret < 0) {
+        // Part of it is still mapped: keep the region, counting what's left
+        region->resident = 0;
+        for (uint32_t va = region->start; va < region->end; va += PAGE_SIZE)
+            if (get_physaddr((void *)va))
+                region->resident++;
+        return ret;
+    }
+    *link = region->next;
+    kfree(region);
+    return 0;
+}
+
+int vm_handle_fault(uint32_t addr, uint32_t error_code) {
+    struct vm_region *r = vm_find(addr);
+    if (!r)
+        return -1;
+    if (error_code & PF_PRESENT)
+        return -1;                          // protection fault on a mapped page
+    if ((error_code & PF_WRITE) && !(r->flags & VM_WRITE))
+        return -1;
+    if ((error_code & PF_USER) && !(r->flags & VM_USER))
+        return -1;
+
+    void *frame = pfa_alloc_frames(0);
+    if (!frame)
+        return -2;
+    zero_page(frame);                       // frames are identity-mapped
+
+    unsigned int pte_flags = 0;
+    if (r->flags & VM_WRITE) pte_flags |= PTE_RW;
+    if (r->flags & VM_USER)  pte_flags |= PTE_USER;
+
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, current_pd());
+    if (map_range(&tlb, align_down(addr, PAGE_SIZE), (uint32_t)(uintptr_t)frame, 1, pte_flags) < 0) {
+        tlb_finish(&tlb);
+        pfa_free_frames(frame, 0);
+        return -2;
+    }
+    tlb_finish(&tlb);                       // no-op: the page wasn't present before
+
+    r->faults++;
+    r->resident++;
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdint.h>
+
+/* ===== Demand-zero virtual memory regions =====
+   vm_reserve() only records a virtual range; nothing is mapped. The first
+   touch of each page faults, and page_fault_handler() backs it with a
+   freshly zeroed frame. Memory is only spent on pages actually used. */
+
+#define VM_WRITE  0x1u   /* pages are writable */
+#define VM_USER   0x2u   /* pages are accessible from ring 3 */
+
+/* Page fault error code bits (pushed by the CPU for vector 14) */
+#define PF_PRESENT 0x1u  /* 0: page not present, 1: protection violation */
+#define PF_WRITE   0x2u  /* fault was a write */
+#define PF_USER    0x4u  /* fault happened in ring 3 */
+
+struct vm_region {
+   uint32_t start;          /* page aligned */
+   uint32_t end;            /* exclusive, page aligned */
+   unsigned int flags;      /* VM_* */
+   uint32_t faults;         /* demand faults served in this region */
+   uint32_t resident;       /* pages currently backed by a frame */
+   struct vm_region *next;  /* sorted by start address */
+};
+
+/* Reserve [start, start + size) for lazy, zero-filled backing. Fails (NULL)
+   if the range overlaps an existing region or memory runs out. */
+struct vm_region *vm_reserve(uint32_t start, uint32_t size, unsigned int flags);
+
+/* Unmap a region and return its backing frames to the frame allocator.
+   Returns 0, or -1 if region isn't reserved or a 4 MiB page in it couldn't
+   be split; the region then stays reserved, with resident counting the
+   pages still mapped. */
+int vm_release(struct vm_region *region);
+
+/* Region containing addr, or NULL. */
+struct vm_region *vm_find(uint32_t addr);
+
+/* Try to resolve a page fault at addr. Returns 0 if handled (the faulting
+   instruction can be restarted), negative if the fault is a real error. */
+int vm_handle_fault(uint32_t addr, uint32_t error_code);
+
+#endif /* VM_H */
@@ -0,0 +1,337 @@
+#include "vmalloc.h"
+#include "kmalloc.h"
+
+/* One range of the VMALLOC window: free (in free_tree) or handed out (in
+   busy_tree). Sizes are in bytes and include an allocation's guard page. */
+struct vmap_area {
+    uint32_t start;
+    uint32_t size;
+    struct vmap_area *left, *right;
+    int height;
+    uint32_t subtree_max;    // largest size in this subtree
+    int owns_frames;         // vfree() returns the frames (vmalloc, not vmap)
+};
+
+static struct kmem_cache *area_cache = NULL;
+static struct vmap_area *free_tree = NULL;
+static struct vmap_area *busy_tree = NULL;
+
+/* ===== AVL tree keyed by start, augmented with subtree_max ===== */
+static inline int height(struct vmap_area *n) { return n ? n->height : 0; }
+static inline uint32_t subtree_max(struct vmap_area *n) { return n ? n->subtree_max : 0; }
+
+static void update(struct vmap_area *n) {
+    int hl = height(n->left), hr = height(n->right);
+    n->height = 1 + (hl > hr ? hl : hr);
+    uint32_t m = n->size;
+    if (subtree_max(n->left) > m)  m = subtree_max(n->left);
+    if (subtree_max(n->right) > m) m = subtree_max(n->right);
+    n->subtree_max = m;
+}
+
+static struct vmap_area *rotate_right(struct vmap_area *y) {
+    struct vmap_area *x = y->left;
+    y->left = x->right;
+    x->right = y;
+    update(y);
+    update(x);
+    return x;
+}
+
+static struct vmap_area *rotate_left(struct vmap_area *x) {
+    struct vmap_area *y = x->right;
+    x->right = y->left;
+    y->left = x;
+    update(x);
+    update(y);
+    return y;
+}
+
+static struct vmap_area *rebalance(struct vmap_area *n) {
+    update(n);
+    int bf = height(n->left) - height(n->right);
+    if (bf > 1) {
+        if (height(n->left->left) < height(n->left->right))
+            n->left = rotate_left(n->left);
+        return rotate_right(n);
+    }
+    if (bf < -1) {
+        if (height(n->right->right) < height(n->right->left))
+            n->right = rotate_right(n->right);
+        return rotate_left(n);
+    }
+    return n;
+}
+
+static struct vmap_area *tree_insert(struct vmap_area *root, struct vmap_area *node) {
+    if (!root) {
+        node->left = node->right = NULL;
+        update(node);
+        return node;
+    }
+    if (node->start < root->start)
+        root->left = tree_insert(root->left, node);
+    else
+        root->right = tree_insert(root->right, node);
+    return rebalance(root);
+}
+
+static struct vmap_area *remove_min(struct vmap_area *root, struct vmap_area **min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = remove_min(root->left, min);
+    return rebalance(root);
+}
+
+// Unlinks the node starting at start (if any) into *out
+static struct vmap_area *tree_remove(struct vmap_area *root, uint32_t start, struct vmap_area **out) {
+    if (!root)
+        return NULL;
+    if (start < root->start) {
+        root->left = tree_remove(root->left, start, out);
+    } else if (start > root->start) {
+        root->right = tree_remove(root->right, start, out);
+    } else {
+        *out = root;
+        struct vmap_area *l = root->left, *r = root->right, *m;
+        if (!r)
+            return l;
+        r = remove_min(r, &m);
+        m->left = l;
+        m->right = r;
+        return rebalance(m);
+    }
+    return rebalance(root);
+}
+
+// Lowest-addressed free range of at least size bytes: O(log n) thanks to
+// subtree_max, which tells which side can still satisfy the request
+static struct vmap_area *first_fit(struct vmap_area *n, uint32_t size) {
+    while (n) {
+        if (subtree_max(n->left) >= size)
+            n = n->left;
+        else if (n->size >= size)
+            return n;
+        else if (subtree_max(n->right) >= size)
+            n = n->right;
+        else
+            return NULL;
+    }
+    return NULL;
+}
+
+// Last range starting below addr / first range starting above it
+static struct vmap_area *tree_prev(struct vmap_area *n, uint32_t addr) {
+    struct vmap_area *best = NULL;
+    while (n) {
+        if (n->start < addr) { best = n; n = n->right; }
+        else n = n->left;
+    }
+    return best;
+}
+
+static struct vmap_area *tree_next(struct vmap_area *n, uint32_t addr) {
+    struct vmap_area *best = NULL;
+    while (n) {
+        if (n->start > addr) { best = n; n = n->left; }
+        else n = n->right;
+    }
+    return best;
+}
+
+/* ===== Range management ===== */
+
+// Carves size bytes off the front of the first free range that fits and
+// records them as busy
+static struct vmap_area *alloc_area(uint32_t size) {
+    if (!area_cache || size == 0)
+        return NULL;
+    struct vmap_area *fit = first_fit(free_tree, size);
+    if (!fit)
+        return NULL;
+
+    struct vmap_area *busy = fit;
+    free_tree = tree_remove(free_tree, fit->start, &busy);
+    if (fit->size > size) {
+        struct vmap_area *rest = kmem_cache_alloc(area_cache);
+        if (!rest) {
+            free_tree = tree_insert(free_tree, fit);
+            return NULL;
+        }
+        rest->start = fit->start + size;
+        rest->size = fit->size - size;
+        free_tree = tree_insert(free_tree, rest);
+    }
+    busy->size = size;
+    busy->owns_frames = 0;
+    busy_tree = tree_insert(busy_tree, busy);
+    return busy;
+}
+
+// Returns a busy range to the free tree, merging it with adjacent free ranges
+static void free_area(struct vmap_area *area) {
+    struct vmap_area *tmp;
+    busy_tree = tree_remove(busy_tree, area->start, &tmp);
+
+    struct vmap_area *prev = tree_prev(free_tree, area->start);
+    if (prev && prev->start + prev->size == area->start) {
+        free_tree = tree_remove(free_tree, prev->start, &tmp);
+        prev->size += area->size;
+        kmem_cache_free(area_cache, area);
+        area = prev;
+    }
+    struct vmap_area *next = tree_next(free_tree, area->start);
+    if (next && area->start + area->size == next->start) {
+        free_tree = tree_remove(free_tree, next->start, &tmp);
+        area->size += next->size;
+        kmem_cache_free(area_cache, next);
+    }
+    free_tree = tree_insert(free_tree, area);
+}
+
+static struct vmap_area *find_busy(uint32_t start) {
+    struct vmap_area *n = busy_tree;
+    while (n && n->start != start)
+        n = start < n->start ? n->left : n->right;
+    return n;
+}
+
+// Unmaps everything but the guard page and releases the range
+static void release_area(struct vmap_area *area) {
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, kernel_pd);
+    unmap_range(&tlb, area->start, area->size / PAGE_SIZE - 1, area->owns_frames);
+    tlb_finish(&tlb);
+    free_area(area);
+}
+
+/* ===== Public API ===== */
+
+void vmalloc_init(void) {
+    if (area_cache)
+        return;
+    area_cache = kmem_cache_create("vmap_area", sizeof(struct vmap_area), 0);
+    if (!area_cache)
+        return;
+    struct vmap_area *all = kmem_cache_alloc(area_cache);
+    if (!all)
+        return;
+    all->start = VMALLOC_START;
+    all->size = VMALLOC_END - VMALLOC_START;
+    free_tree = tree_insert(NULL, all);
+}
+
+void *vmalloc(uint32_t size) {
+    uint32_t npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (npages == 0 || npages >= (VMALLOC_END - VMALLOC_START) / PAGE_SIZE)
+        return NULL;
+    struct vmap_area *area = alloc_area((npages + 1) * PAGE_SIZE);   // + guard page
+    if (!area)
+        return NULL;
+    area->owns_frames = 1;
+
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, kernel_pd);
+    uint32_t va = area->start;
+    for (uint32_t i = 0; i < npages; ++i, va += PAGE_SIZE) {
+        void *frame = pfa_alloc_frames(0);
+        if (!frame || map_range(&tlb, va, (uint32_t)(uintptr_t)frame, 1, PTE_RW) < 0) {
+            if (frame) pfa_free_frames(frame, 0);
+            tlb_finish(&tlb);
+            release_area(area);                 // frees the pages mapped so far
+            return NULL;
+        }
+    }
+    tlb_finish(&tlb);   // no-op: nothing was present before
+    return (void *)area->start;
+}
+
+void vfree(void *addr) {
+    if (!addr)
+        return;
+    struct vmap_area *area = find_busy((uint32_t)(uintptr_t)addr);
+    if (area && area->owns_frames)
+        release_area(area);
+}
+
+void *vmap(struct ppage *pglist, unsigned int flags) {
+    uint32_t npages = 0;
+    for (struct ppage *p = pglist; p; p = p->next)
+        npages += 1u << p->order;
+    if (npages == 0)
+        return NULL;
+    struct vmap_area *area = alloc_area((npages + 1) * PAGE_SIZE);
+    if (!area)
+        return NULL;
+
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, kernel_pd);
+    uint32_t va = area->start;
+    for (struct ppage *p = pglist; p; p = p->next) {
+        uint32_t n = 1u << p->order;
+        if (map_range(&tlb, va, (uint32_t)(uintptr_t)p->physical_addr, n, flags) < 0) {
+            tlb_finish(&tlb);
+            release_area(area);
+            return NULL;
+        }
+        va += n * PAGE_SIZE;
+    }
+    tlb_finish(&tlb);
+    return (void *)area->start;
+}
+
+void vunmap(void *addr) {
+    if (!addr)
+        return;
+    struct vmap_area *area = find_busy((uint32_t)(uintptr_t)addr);
+    if (area && !area->owns_frames)
+        release_area(area);
+}
+
+static void *map_phys(uint32_t phys, uint32_t size, unsigned int flags) {
+    uint32_t offset = phys & (PAGE_SIZE - 1);
+    uint32_t npages = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (size == 0 || npages >= (VMALLOC_END - VMALLOC_START) / PAGE_SIZE)
+        return NULL;
+    struct vmap_area *area = alloc_area((npages + 1) * PAGE_SIZE);
+    if (!area)
+        return NULL;
+
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, kernel_pd);
+    if (map_range(&tlb, area->start, phys - offset, npages, flags) < 0) {
+        tlb_finish(&tlb);
+        release_area(area);
+        return NULL;
+    }
+    tlb_finish(&tlb);
+    return (void *)(area->start + offset);
+}
+
+void *ioremap(uint32_t phys, uint32_t size) {
+    return map_phys(phys, size, PTE_RW | PTE_PCD | PTE_PWT);
+}
+
+void *memremap_ro(uint32_t phys, uint32_t size) {
+    return map_phys(phys, size, 0);
+}
+
+void iounmap(void *addr) {
+    if (addr)
+        vunmap((void *)((uint32_t)(uintptr_t)addr & ~(PAGE_SIZE - 1)));
+}
+
+int vmalloc_sync_fault(uint32_t addr) {
+    if (addr < VMALLOC_START || addr >= VMALLOC_END)
+        return -1;
+    uint32_t cr3;
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3));
+    struct page_directory_entry *pd = (struct page_directory_entry *)(cr3 & ~0xFFFu);
+    uint32_t pdi = addr >> 22;
+    if (pd == kernel_pd || !kernel_pd[pdi].present || pd[pdi].present)
+        return -1;
+    pd[pdi] = kernel_pd[pdi];
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include <stdint.h>
+#include "page.h"   // for struct ppage
+#include "paging.h" // for KERNEL_VA_BASE
+
+/* ===== Kernel virtual address allocator =====
+   Hands out ranges of the kernel's VMALLOC window and maps them in kernel_pd.
+   Free ranges live in an AVL tree keyed by address and augmented with the
+   largest free size in each subtree, so a first-fit range is found in
+   O(log n); freed ranges are merged with their neighbours. Every allocation
+   is followed by an unmapped guard page.
+
+   Mappings go into kernel_pd. Its page tables in this window are never
+   freed, and a directory cloned before one was created picks the PDE up
+   lazily in vmalloc_sync_fault(). */
+
+#define VMALLOC_START KERNEL_VA_BASE
+#define VMALLOC_END   0xFF800000u   /* below the recursive mapping at 0xFFC00000 */
+
+// Sets up the free range tree. Call once after kmalloc_init().
+void vmalloc_init(void);
+
+// Virtually contiguous, R/W kernel memory backed by (possibly scattered)
+// 4 KiB frames. Returns NULL if out of address space or memory.
+void *vmalloc(uint32_t size);
+
+// Unmaps memory from vmalloc() and frees its frames
+void vfree(void *addr);
+
+// Maps a list of physical blocks (e.g. from allocate_physical_pages())
+// contiguously at a fresh address, with low 12-bit PTE flags
+void *vmap(struct ppage *pglist, unsigned int flags);
+
+// Unmaps a vmap() range; the frames are left to the caller
+void vunmap(void *addr);
+
+// Maps [phys, phys + size) of device memory uncached (PCD|PWT) at a fresh
+// address and returns the address corresponding to phys (it need not be
+// page aligned). Returns NULL if out of address space or page tables.
+void *ioremap(uint32_t phys, uint32_t size);
+
+// Same, but cacheable and read-only: for firmware tables such as ACPI's
+void *memremap_ro(uint32_t phys, uint32_t size);
+
+// Unmaps an ioremap()/memremap_ro() range
+void iounmap(void *addr);
+
+// Page fault hook: copies a missing VMALLOC-window PDE from kernel_pd into
+// the current directory. Returns 0 if that resolved the fault.
+int vmalloc_sync_fault(uint32_t addr);
+
+#endif /* VMALLOC_H */